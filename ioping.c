@@ -39,6 +39,7 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdatomic.h>
 #include <getopt.h>
 #include <string.h>
@@ -60,13 +61,20 @@
 # include <sys/sysmacros.h>
 # include <sys/syscall.h>
 # include <sys/mman.h>
+# include <sys/prctl.h>
 # define HAVE_CLOCK_GETTIME
+# define HAVE_MMAP
+# define HAVE_CLOCK_NANOSLEEP
+# define HAVE_TIMER_SLACK
 # define HAVE_POSIX_FADVICE
 # define HAVE_POSIX_FDATASYNC
 # define HAVE_POSIX_MEMALIGN
 # define HAVE_MKOSTEMP
 # define HAVE_DIRECT_IO
+# define HAVE_FALLOCATE
 # define HAVE_LINUX_ASYNC_IO
+# define HAVE_PTHREAD
+# define HAVE_SCHED_SETAFFINITY
 # define HAVE_ERR_INCLUDE
 # define HAVE_STATVFS
 # define MAX_RW_COUNT		0x7ffff000 /* 2G - 4K */
@@ -131,7 +139,11 @@
 # include <sys/ioctl.h>
 # include <sys/mount.h>
 # include <sys/disk.h>
+# include <sys/mman.h>
 # define HAVE_CLOCK_GETTIME
+# define HAVE_CLOCK_NANOSLEEP
+# define HAVE_MMAP
+# define HAVE_PTHREAD
 # define HAVE_MKOSTEMP
 # define HAVE_DIRECT_IO
 # define HAVE_ERR_INCLUDE
@@ -206,6 +218,42 @@
 # include <sys/statvfs.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+# include <pthread.h>
+# include <sys/socket.h>
+# include <netdb.h>
+#endif
+
+#ifdef HAVE_SCHED_SETAFFINITY
+# include <sched.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# include <cpuid.h>
+# define HAVE_RDTSC
+# ifdef __SSE2__
+#  define HAVE_SSE2
+# endif
+# ifdef __GNUC__
+#  define HAVE_AVX2	/* detected at runtime */
+# endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+# include <arm_neon.h>
+# define HAVE_NEON
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define HAVE_CRC32C_SSE42	/* detected at runtime */
+#endif
+
+#ifdef __ARM_FEATURE_CRC32
+# include <arm_acle.h>
+# define HAVE_CRC32C_ARM
+#endif
+
 #ifdef HAVE_ERR_INCLUDE
 # include <err.h>
 #else
@@ -294,14 +342,14 @@ static const char *errno_name(void)
 #define NSEC_PER_SEC	1000000000ll
 #define USEC_PER_SEC	1000000L
 
-int timestamp_uptodate;
-char timestamp_str[64];
-char localtime_str[64];
+_Thread_local int timestamp_uptodate;
+_Thread_local char timestamp_str[64];
+_Thread_local char localtime_str[64];
 const char *localtime_fmt = "%b %d %T";
 
 #ifdef HAVE_CLOCK_GETTIME
 
-static inline long long now(void)
+static inline long long system_now(void)
 {
 	struct timespec ts;
 
@@ -333,7 +381,7 @@ static inline void update_timestamp(void)
 
 #else
 
-static inline long long now(void)
+static inline long long system_now(void)
 {
 	struct timeval tv;
 
@@ -366,6 +414,177 @@ static inline void update_timestamp(void)
 
 #endif /* HAVE_CLOCK_GETTIME */
 
+#ifdef HAVE_CLOCK_GETTIME
+const char *clock_source = "monotonic";
+#else
+const char *clock_source = "gettimeofday";
+#endif
+int tsc_clock = 0;
+long long clock_overhead;
+long long clock_resolution;
+
+#ifdef HAVE_RDTSC
+
+/* calibration at start */
+unsigned long long tsc_start0;
+long long tsc_base0;
+double tsc_scale0;
+
+/*
+ * Each thread extrapolates TSC from own anchor, which is moved every
+ * TSC_ANCHOR_PERIOD and slewed to system clock, so error of calibration
+ * does not grow with run time and clock stays continuous.
+ */
+#define TSC_ANCHOR_PERIOD	NSEC_PER_SEC
+#define TSC_MAX_ERROR		1000000
+
+_Thread_local unsigned long long tsc_start, tsc_next;
+_Thread_local long long tsc_base;
+_Thread_local double tsc_scale;
+
+static inline unsigned long long rdtscp(void)
+{
+	unsigned aux;
+
+	/* waits for completion of all previous instructions */
+	return __rdtscp(&aux);
+}
+
+static bool tsc_invariant(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	/* rdtscp */
+	if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) ||
+	    !(edx & (1u << 27)))
+		return false;
+
+	/* invariant tsc: constant rate in all P/C-states */
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) ||
+	    !(edx & (1u << 8)))
+		return false;
+
+	return true;
+}
+
+static void tsc_calibrate(void)
+{
+	struct timespec ts = { 0, 20000000 };
+	unsigned long long c0, c1;
+	long long t0, t1;
+
+	c0 = rdtscp();
+	t0 = system_now();
+	c0 = (c0 + rdtscp()) / 2;
+
+	nanosleep(&ts, NULL);
+
+	c1 = rdtscp();
+	t1 = system_now();
+	c1 = (c1 + rdtscp()) / 2;
+
+	tsc_scale0 = (double)(t1 - t0) / (c1 - c0);
+	tsc_start0 = c0;
+	tsc_base0 = t0;
+}
+
+static void tsc_anchor(unsigned long long cycles)
+{
+	long long val, sys, error;
+	double rate;
+
+	if (!tsc_scale) {
+		tsc_start = tsc_start0;
+		tsc_base = tsc_base0;
+		tsc_scale = tsc_scale0;
+	}
+
+	val = tsc_base + (long long)((cycles - tsc_start) * tsc_scale);
+	sys = system_now();
+	error = sys - val;
+
+	/* rate measured over whole run, offset is absorbed in next period */
+	rate = (double)(sys - tsc_base0) / (cycles - tsc_start0);
+	if (error > TSC_MAX_ERROR || error < -TSC_MAX_ERROR) {
+		/* clock stepped, suspend or so */
+		val = sys;
+		error = 0;
+	}
+
+	tsc_base = val;
+	tsc_start = cycles;
+	tsc_scale = rate * (1 + (double)error / TSC_ANCHOR_PERIOD);
+	tsc_next = cycles + (unsigned long long)(TSC_ANCHOR_PERIOD / rate);
+}
+
+#endif /* HAVE_RDTSC */
+
+static inline long long now(void)
+{
+#ifdef HAVE_RDTSC
+	if (tsc_clock) {
+		unsigned long long cycles = rdtscp();
+
+		if ((long long)(cycles - tsc_next) >= 0)
+			tsc_anchor(cycles);
+		return tsc_base + (long long)((cycles - tsc_start) * tsc_scale);
+	}
+#endif
+	return system_now();
+}
+
+/* absolute deadline for sleeping in system clock */
+static inline long long system_deadline(long long deadline)
+{
+#ifdef HAVE_RDTSC
+	if (tsc_clock)
+		return system_now() + (deadline - now());
+#endif
+	return deadline;
+}
+
+/* measurement floor: cost of reading clock and minimal visible step */
+static void clock_measure(void)
+{
+	long long start, prev, next;
+	int i;
+
+	start = now();
+	for (i = 0; i < 1000; i++)
+		(void)now();
+	clock_overhead = (now() - start) / 1001;
+
+	clock_resolution = LLONG_MAX;
+	for (i = 0; i < 100; i++) {
+		prev = now();
+		do
+			next = now();
+		while (next == prev);
+		if (next - prev < clock_resolution)
+			clock_resolution = next - prev;
+	}
+}
+
+static void clock_init(void)
+{
+	if (tsc_clock) {
+#ifdef HAVE_RDTSC
+		if (tsc_invariant()) {
+			tsc_calibrate();
+			clock_source = "tsc";
+		} else {
+			warnx("TSC is not invariant, using %s clock", clock_source);
+			tsc_clock = 0;
+		}
+#else
+		warnx("TSC is not supported, using %s clock", clock_source);
+		tsc_clock = 0;
+#endif
+	}
+
+	clock_measure();
+}
+
 #ifndef HAVE_MKOSTEMP
 int mkostemp(char *template, int flags)
 {
@@ -597,29 +816,142 @@ void print_time(long long val)
 	print_suffix(val, time_suffix);
 }
 
-char *path = NULL;
-char *fstype = "";
-char *device = "";
-long long device_size = 0;
+/*
+ * Log-linear latency histogram: values below 2 * HIST_SUB_COUNT are exact,
+ * above that each power of two is split into HIST_SUB_COUNT buckets, which
+ * gives precision better than 1% up to 2^HIST_MAX_BITS ns (about 9 hours).
+ */
+#define HIST_SUB_BITS	7
+#define HIST_SUB_COUNT	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	45
+#define HIST_SIZE	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+static const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+
+#define NR_PERCENTILES	(sizeof(percentiles) / sizeof(percentiles[0]))
+
+struct statistics {
+	long long start, finish, load_time;
+	long long count, valid, too_slow, too_fast, failed;
+	long long corrupted;		/* -verify mismatches */
+	long long min, max;
+	double sum, sum2, avg, mdev;
+	double speed, iops, load_speed, load_iops;
+	long long size, load_size;
+	long long percentile[NR_PERCENTILES];
+	long long *hist;	/* HIST_SIZE buckets, only if group is reported */
+	long long sched_count, sched_min, sched_max;	/* start behind schedule */
+	double sched_sum, sched_avg;
+};
+
+#define MAX_SIZE_SPLIT	16
+
+/* metadata operations, -metadata */
+enum {
+	META_CREATE,
+	META_UNLINK,
+	META_STAT,
+	META_OPEN,
+	META_RENAME,
+	META_MKDIR,
+	META_RMDIR,
+	NR_META_OPS,
+};
+
+static const char *meta_names[NR_META_OPS] = {
+	"create", "unlink", "stat", "open", "rename", "mkdir", "rmdir",
+};
+
+/* statistics of target or worker */
+struct statset {
+	struct statistics all;
+	struct statistics co;		/* -co-correct */
+	struct statistics op[2];	/* reads and writes */
+	struct statistics split[MAX_SIZE_SPLIT];	/* -size-split */
+	struct statistics data;		/* writes without cache flush */
+	struct statistics sync;		/* cache flushes */
+	struct statistics meta[NR_META_OPS];	/* -metadata */
+};
+
+struct target {
+	char		*path;
+	char		*fstype;
+	char		*device;
+	long long	device_size;
+	off_t		wsize;
+	unsigned long long blocks;	/* requests in working set */
+	unsigned long long spread;	/* see spread_block() */
+	double		zipf_hn;
+	char		*meta_path;	/* pool directory for -metadata */
+	char		*map;		/* mapping of file for -mmap */
+	unsigned char	*verify_map;	/* expected tags of blocks for -verify */
+	long long	prep_size, prep_time;	/* filling of temporary file */
+	int		prep_writers;
+	int		fd;
+	atomic_llong	claimed_request;
+	struct statset	part, total;
+};
+
+struct target *targets;
+int nr_targets;
 
-int target_fd = -1;
-void *buf;
+/* state of current thread */
+_Thread_local struct target *target;
+_Thread_local int target_fd = -1;
+_Thread_local void *buf;
 
-const char *notice = NULL;
+_Thread_local const char *notice = NULL;
 
 int quiet = 0;
 int time_info = 0;
 int batch_mode = 0;
 int async_uring = 0;
+int uring_fixed = 0;
+unsigned uring_flags = 0;
+int uring_sq_cpu = -1;
+const char *engine = "pread";
+char engine_mode[64];
+int iodepth = 1;
+int nr_threads = 1;
+int nr_workers = 1;
+int *cpus;
+int nr_cpus;
 int direct = 0;
 int cached = 0;
 int rw_flags = 0;
 int syncio = 0;
 int data_syncio = 0;
 int randomize = 1;
+
+enum {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_PARETO,
+	DIST_HOTCOLD,
+} distribution = DIST_UNIFORM;
+
+double dist_param;		/* zipf theta or pareto shape */
+double dist_pareto_pow;
+double dist_hot_requests, dist_hot_size;
 int write_test = 0;
 int write_read_test = 0;
 int ignore_error = 0;
+int rw_mix = -1;
+int co_correct = 0;
+int sync_ping = 0;
+int use_mmap = 0;
+double compress_ratio = 0;
+double dedupe_ratio = 0;
+int verify = 0;
+const char *metrics_addr;
+const char *metrics_file;
+int metrics_only = 0;		/* period is set only for metrics */
+off_t page_size = 4096;
+
+int meta_ops[NR_META_OPS * 2];	/* cycle of metadata operations */
+int nr_meta_ops;
+bool meta_used[NR_META_OPS];
+int meta_files = 1000;
 
 unsigned long long random_entropy = 0;
 
@@ -628,7 +960,22 @@ long long period_time = 0;
 
 int custom_interval, custom_deadline;
 long long interval = NSEC_PER_SEC;
-struct timespec interval_ts;
+long long co_interval;
+
+enum {
+	ARRIVAL_FIXED,
+	ARRIVAL_JITTER,
+	ARRIVAL_POISSON,
+	ARRIVAL_ONOFF,
+} arrival = ARRIVAL_FIXED;
+
+long long spin_time = 0;
+long long timer_slack = -1;
+
+int arrival_jitter_pct = 10;
+long long arrival_jitter;
+long long arrival_on, arrival_off;
+_Thread_local long long arrival_switch;	/* end of current on period */
 long long deadline = 0;
 long long speed_limit = 0;
 double rate_limit = 0;
@@ -637,27 +984,69 @@ long long min_valid_time = 0;
 long long max_valid_time = LLONG_MAX;
 
 ssize_t default_size = 1<<12;
-ssize_t size = 0;
+ssize_t size = 0;		/* largest request */
+ssize_t min_size;		/* granularity of offsets */
+
+struct size_split {
+	char		*name;
+	ssize_t		size;
+	int		weight;
+} size_split[MAX_SIZE_SPLIT];
+
+int nr_size_split;
+int size_split_weight;
 off_t wsize = 0;
 off_t temp_wsize = 1<<20;
 
 int keep_file = 0;
 
 off_t offset = 0;
-off_t woffset = 0;
+_Thread_local off_t woffset = 0;
 
-long long request = 0;
+_Thread_local long long request = 0;
 long long warmup_request = 1;
 long long burst = 0;
-long long burst_request = 0;
+_Thread_local long long burst_request = 0;
 long long stop_at_request = 0;
 
 int json = 0;
 int json_line = 0;
 
+const char *trace_path;
+const char *trace_decode;
+const char *replay_path;
+
 int exiting = 0;
 
-const char *options = "hvkALRDNHCWGEYBUqyi:t:T:w:s:S:c:o:p:P:l:r:a:I::Je:b:";
+const char *options = "hvkALRDNHCWGEYBUqyi:t:T:w:s:S:c:o:p:P:l:r:a:I::Je:b:Q:";
+
+/* long options without short equivalent */
+enum {
+	OPT_URING_FIXED = 0x100,
+	OPT_URING_MODE,
+	OPT_THREADS,
+	OPT_CPUS,
+	OPT_CO_CORRECT,
+	OPT_ARRIVAL,
+	OPT_SPIN,
+	OPT_TIMER_SLACK,
+	OPT_CLOCK,
+	OPT_TRACE,
+	OPT_DECODE,
+	OPT_REPLAY,
+	OPT_RWMIX,
+	OPT_DISTRIBUTION,
+	OPT_SIZE_SPLIT,
+	OPT_SYNC_PING,
+	OPT_METADATA,
+	OPT_METADATA_FILES,
+	OPT_MMAP,
+	OPT_COMPRESS,
+	OPT_DEDUPE,
+	OPT_VERIFY,
+	OPT_METRICS_PORT,
+	OPT_METRICS_FILE,
+};
 
 #ifdef HAVE_GETOPT_LONG_ONLY
 
@@ -682,21 +1071,41 @@ static struct option long_options[] = {
 	{"dsync",	no_argument,		NULL,	'y'},
 	{"async",	no_argument,		NULL,	'A'},
 	{"uring",	no_argument,		NULL,	'U'},
+	{"uring-fixed",	no_argument,		NULL,	OPT_URING_FIXED},
+	{"uring-mode",	required_argument,	NULL,	OPT_URING_MODE},
+	{"mmap",	no_argument,		NULL,	OPT_MMAP},
 	{"write",	no_argument,		NULL,	'W'},
 	{"read-write",	no_argument,		NULL,	'G'},
+	{"rwmix",	required_argument,	NULL,	OPT_RWMIX},
+	{"sync-ping",	no_argument,		NULL,	OPT_SYNC_PING},
+	{"metadata",	required_argument,	NULL,	OPT_METADATA},
+	{"metadata-files", required_argument,	NULL,	OPT_METADATA_FILES},
 	{"ignore-error",no_argument,		NULL,	'E'},
+	{"verify",	no_argument,		NULL,	OPT_VERIFY},
 
 	{"size",	required_argument,	NULL,	's'},
+	{"size-split",	required_argument,	NULL,	OPT_SIZE_SPLIT},
+	{"compress",	required_argument,	NULL,	OPT_COMPRESS},
+	{"dedupe",	required_argument,	NULL,	OPT_DEDUPE},
 	{"work-size",	required_argument,	NULL,	'S'},
 	{"work-offset",	required_argument,	NULL,	'o'},
+	{"distribution", required_argument,	NULL,	OPT_DISTRIBUTION},
 
 	{"count",	required_argument,	NULL,	'c'},
+	{"iodepth",	required_argument,	NULL,	'Q'},
+	{"threads",	required_argument,	NULL,	OPT_THREADS},
+	{"cpus",	required_argument,	NULL,	OPT_CPUS},
 	{"work-time",	required_argument,	NULL,	'w'},
 
 	{"interval",	required_argument,	NULL,	'i'},
 	{"burst",	required_argument,	NULL,	'b'},
 	{"speed-limit",	required_argument,	NULL,	'l'},
 	{"rate-limit",  required_argument,	NULL,	'r'},
+	{"arrival",	required_argument,	NULL,	OPT_ARRIVAL},
+	{"spin",	required_argument,	NULL,	OPT_SPIN},
+	{"timer-slack",	required_argument,	NULL,	OPT_TIMER_SLACK},
+	{"clock",	required_argument,	NULL,	OPT_CLOCK},
+	{"co-correct",	no_argument,		NULL,	OPT_CO_CORRECT},
 
 	{"warmup",	required_argument,	NULL,	'a'},
 	{"min-time",	required_argument,	NULL,	't'},
@@ -706,6 +1115,12 @@ static struct option long_options[] = {
 	{"print-interval", required_argument,	NULL,	'P'},
 
 	{"entropy",	required_argument,	NULL,	'e'},
+	{"replay",	required_argument,	NULL,	OPT_REPLAY},
+
+	{"trace",	required_argument,	NULL,	OPT_TRACE},
+	{"decode",	required_argument,	NULL,	OPT_DECODE},
+	{"metrics-port", required_argument,	NULL,	OPT_METRICS_PORT},
+	{"metrics-file", required_argument,	NULL,	OPT_METRICS_FILE},
 
 	{0,		0,			NULL,	0},
 };
@@ -715,7 +1130,7 @@ static struct option long_options[] = {
 void usage(FILE *output)
 {
 	fprintf(output,
-			" Usage: ioping [options...] directory|file|device\n"
+			" Usage: ioping [options...] directory|file|device...\n"
 			"        ioping -h | -v\n"
 			"\n"
 			" options:\n"
@@ -723,17 +1138,27 @@ void usage(FILE *output)
 			"      -C, -cached                use cached I/O (no cache flush/drop)\n"
 			"      -D, -direct                use direct I/O (O_DIRECT)\n"
 			"      -E  -ignore-error          continue after request failure\n"
+			"          -verify                write checksummed blocks, verify reads\n"
 			"      -G, -read-write            read-write ping-pong mode\n"
+			"          -rwmix <percent>       random mix with <percent> of writes\n"
+			"          -sync-ping             measure only cache flush after each write\n"
+			"          -metadata <op,...>     metadata ops: create,stat,open,rename,mkdir\n"
+			"          -metadata-files <count> files in metadata pool (1000)\n"
 			"      -L, -linear                use sequential operations\n"
 			"      -N, -nowait                use nowait I/O (RWF_NOWAIT)\n"
 			"      -H, -hipri                 use high priority I/O (RWF_HIPRI)\n"
 			"      -U, -uring		  use asynchronous I/O uring\n"
+			"          -uring-fixed           use registered buffers and file for I/O uring\n"
+			"          -uring-mode <mode,...> I/O uring setup: sqpoll[:cpu],single,coop,defer\n"
+			"          -mmap                  touch memory mapping, measure page faults\n"
 			"      -W, -write                 use write I/O (please read manpage)\n"
 			"      -Y, -sync                  use sync I/O (O_SYNC)\n"
 			"      -y, -dsync                 use data sync I/O (O_DSYNC)\n"
 			"      -R, -rapid                 test with rapid I/O during 3s (-q -i 0 -w 3)\n"
 			"      -k, -keep                  keep and reuse temporary file (ioping.tmp)\n"
 			"\n"
+	       );
+	fprintf(output,
 			" parameters:\n"
 			"      -a, -warmup <count>        ignore <count> first requests (1)\n"
 			"      -b, -burst <count>         make <count> requsts without delay (0)\n"
@@ -741,11 +1166,24 @@ void usage(FILE *output)
 			"      -e, -entropy <seed>        seed for random number generator (0)\n"
 			"      -i, -interval <time>       interval between requests (1s)\n"
 			"      -s, -size <size>           request size (4k)\n"
+			"          -size-split <list>     weighted request sizes (4k/60:64k/40)\n"
+			"          -compress <ratio>      write data compressible with <ratio> (2:1)\n"
+			"          -dedupe <ratio>        write data deduplicable with <ratio> (4:1)\n"
 			"      -S, -work-size <size>      working set size (1m)\n"
 			"      -o, -work-offset <size>    working set offset (0)\n"
+			"          -distribution <model>  uniform,zipf:<theta>,pareto:<h>,hotcold:<r>:<s>\n"
+			"      -Q, -iodepth <count>       keep <count> async requests in flight (1)\n"
+			"          -threads <count>       run <count> workers in parallel (1)\n"
+			"          -cpus <list>           bind workers to cpus (0,2-3)\n"
 			"      -w, -work-time <time>      stop after <time> passed\n"
 			"      -l, -speed-limit <size>    limit speed with <size> per second\n"
 			"      -r, -rate-limit <count>    limit rate with <count> per second\n"
+			"          -arrival <model>       fixed,jitter[:pct],poisson,onoff:<on>:<off>\n"
+			"          -replay <file>         replay requests from text or binary trace\n"
+			"          -co-correct            correct latency for coordinated omission\n"
+			"          -spin <time>           busy-wait last <time> before request (0)\n"
+			"          -timer-slack <time>    set timer slack for sleeping between requests\n"
+			"          -clock <source>        clock for timing requests: monotonic, tsc\n"
 			"      -t, -min-time <time>       minimal valid request time (0us)\n"
 			"      -T, -max-time <time>       maximum valid request time\n"
 			"\n"
@@ -756,15 +1194,224 @@ void usage(FILE *output)
 			"      -p, -print-count <count>   print statistics for every <count> requests\n"
 			"      -P, -print-interval <time> print statistics for every <time>\n"
 			"      -q, -quiet                 suppress human-readable output\n"
+			"          -trace <file>          write binary trace of requests into <file>\n"
+			"          -decode <format>       print given traces as: stat, csv\n"
+			"          -metrics-port <[host:]port> serve Prometheus metrics over HTTP\n"
+			"          -metrics-file <file>   write Prometheus metrics into <file>\n"
 			"      -h, -help                  display this message and exit\n"
 			"      -v, -version               display version and exit\n"
 			"\n"
 	       );
 }
 
+void parse_uring_mode(const char *str)
+{
+	char *modes = strdup(str), *ptr = modes, *mode;
+
+	while ((mode = strsep(&ptr, ","))) {
+		if (!strncmp(mode, "sqpoll", 6) && (!mode[6] || mode[6] == ':')) {
+#ifdef IORING_SETUP_SQPOLL
+			uring_flags |= IORING_SETUP_SQPOLL;
+			if (mode[6]) {
+				uring_flags |= IORING_SETUP_SQ_AFF;
+				uring_sq_cpu = parse_int(mode + 7);
+			}
+#else
+			errx(1, "I/O uring mode \"%s\" is not supported by this build", mode);
+#endif
+		} else if (!strcmp(mode, "single")) {
+#ifdef IORING_SETUP_SINGLE_ISSUER
+			uring_flags |= IORING_SETUP_SINGLE_ISSUER;
+#else
+			errx(1, "I/O uring mode \"%s\" is not supported by this build", mode);
+#endif
+		} else if (!strcmp(mode, "coop")) {
+#ifdef IORING_SETUP_COOP_TASKRUN
+			uring_flags |= IORING_SETUP_COOP_TASKRUN;
+#else
+			errx(1, "I/O uring mode \"%s\" is not supported by this build", mode);
+#endif
+		} else if (!strcmp(mode, "defer")) {
+#ifdef IORING_SETUP_DEFER_TASKRUN
+			/* kernel requires single issuer for deferred task work */
+			uring_flags |= IORING_SETUP_DEFER_TASKRUN |
+				       IORING_SETUP_SINGLE_ISSUER;
+#else
+			errx(1, "I/O uring mode \"%s\" is not supported by this build", mode);
+#endif
+		} else
+			errx(1, "unknown I/O uring mode: \"%s\"", mode);
+	}
+
+	free(modes);
+}
+
+void parse_cpus(const char *str)
+{
+	char *list = strdup(str), *ptr = list, *range;
+
+	while ((range = strsep(&ptr, ","))) {
+		char *last = strchr(range, '-');
+		int cpu, first;
+
+		if (last)
+			*last++ = 0;
+		first = parse_int(range);
+		for (cpu = first; cpu <= (last ? parse_int(last) : first); cpu++) {
+			cpus = realloc(cpus, sizeof(*cpus) * (nr_cpus + 1));
+			if (!cpus)
+				err(2, NULL);
+			cpus[nr_cpus++] = cpu;
+		}
+	}
+
+	free(list);
+}
+
+void parse_arrival(const char *str)
+{
+	char *args = strdup(str), *ptr = args, *model;
+
+	model = strsep(&ptr, ":");
+	if (!strcmp(model, "fixed") && !ptr) {
+		arrival = ARRIVAL_FIXED;
+	} else if (!strcmp(model, "jitter")) {
+		arrival = ARRIVAL_JITTER;
+		if (ptr)
+			arrival_jitter_pct = parse_int(ptr);
+		if (arrival_jitter_pct > 100)
+			errx(1, "jitter must be not greater than 100%%");
+	} else if (!strcmp(model, "poisson") && !ptr) {
+		arrival = ARRIVAL_POISSON;
+	} else if (!strcmp(model, "onoff") && ptr && strchr(ptr, ':')) {
+		arrival = ARRIVAL_ONOFF;
+		arrival_on = parse_time(strsep(&ptr, ":"));
+		arrival_off = parse_time(ptr);
+		if (arrival_on <= 0)
+			errx(1, "on period must be greater than zero");
+	} else
+		errx(1, "unknown arrival model: \"%s\"", str);
+
+	free(args);
+}
+
+static double parse_fraction(const char *str, double min, double max)
+{
+	char *end;
+	double val = strtod(str, &end);
+
+	if (end == str || *end || val <= min || val >= max)
+		errx(1, "invalid distribution parameter: \"%s\"", str);
+	return val;
+}
+
+/* "2", "2:1" or "3:2" */
+static double parse_ratio(const char *str)
+{
+	const char *ptr = str;
+	double val, div = 1;
+	char *end;
+
+	val = strtod(ptr, &end);
+	if (end != ptr && *end == ':') {
+		ptr = end + 1;
+		div = strtod(ptr, &end);
+	}
+	if (end == ptr || *end || div <= 0 || val < div)
+		errx(1, "invalid ratio: \"%s\", must be at least 1:1", str);
+	return val / div;
+}
+
+void parse_distribution(const char *str)
+{
+	char *args = strdup(str), *ptr = args, *model;
+
+	model = strsep(&ptr, ":");
+	if (!strcmp(model, "uniform") && !ptr) {
+		distribution = DIST_UNIFORM;
+	} else if (!strcmp(model, "zipf") && ptr) {
+		distribution = DIST_ZIPF;
+		dist_param = parse_fraction(ptr, 0, INFINITY);
+	} else if (!strcmp(model, "pareto") && ptr) {
+		distribution = DIST_PARETO;
+		dist_param = parse_fraction(ptr, 0, 1);
+		/* share h of working set gets 1-h of requests */
+		dist_pareto_pow = log(dist_param) / log(1 - dist_param);
+	} else if (!strcmp(model, "hotcold") && ptr && strchr(ptr, ':')) {
+		distribution = DIST_HOTCOLD;
+		dist_hot_requests = parse_fraction(strsep(&ptr, ":"), 0, 100) / 100;
+		dist_hot_size = parse_fraction(ptr, 0, 100) / 100;
+	} else
+		errx(1, "unknown distribution: \"%s\"", str);
+
+	free(args);
+}
+
+void parse_size_split(const char *str)
+{
+	char *list = strdup(str), *ptr = list, *item;
+
+	nr_size_split = 0;
+	size_split_weight = 0;
+
+	while ((item = strsep(&ptr, ":"))) {
+		struct size_split *split = &size_split[nr_size_split];
+		char *weight = strchr(item, '/');
+
+		if (nr_size_split == MAX_SIZE_SPLIT)
+			errx(1, "too many sizes in split, %d at most",
+			     MAX_SIZE_SPLIT);
+		if (!weight)
+			errx(1, "size without weight in split: \"%s\"", item);
+		*weight++ = 0;
+
+		split->name = strdup(item);
+		split->size = parse_size(item);
+		split->weight = parse_int(weight);
+		if (split->size <= 0 || split->weight <= 0)
+			errx(1, "size and weight must be greater than zero");
+		size_split_weight += split->weight;
+		nr_size_split++;
+	}
+
+	free(list);
+}
+
+/* create and mkdir are followed by unlink and rmdir */
+void parse_metadata(const char *str)
+{
+	char *list, *ptr, *name;
+	int op;
+
+	if (!strcmp(str, "all"))
+		str = "create,stat,open,rename,mkdir";
+
+	list = ptr = strdup(str);
+	nr_meta_ops = 0;
+	memset(meta_used, 0, sizeof(meta_used));
+
+	while ((name = strsep(&ptr, ","))) {
+		for (op = 0; op < NR_META_OPS; op++)
+			if (!strcmp(name, meta_names[op]))
+				break;
+		if (op == META_UNLINK || op == META_RMDIR || op == NR_META_OPS)
+			errx(1, "unknown metadata operation: \"%s\"", name);
+		if (nr_meta_ops + 2 > NR_META_OPS * 2)
+			errx(1, "too many metadata operations");
+		meta_ops[nr_meta_ops++] = op;
+		meta_used[op] = true;
+		if (op == META_CREATE || op == META_MKDIR) {
+			meta_ops[nr_meta_ops++] = op + 1;
+			meta_used[op + 1] = true;
+		}
+	}
+
+	free(list);
+}
+
 void parse_options(int argc, char **argv)
 {
-	int opt;
+	int opt, i;
 
 	if (argc < 2) {
 		usage(stdout);
@@ -829,6 +1476,14 @@ void parse_options(int argc, char **argv)
 			case 'U':
 				async_uring = 1;
 				break;
+			case OPT_URING_FIXED:
+				async_uring = 1;
+				uring_fixed = 1;
+				break;
+			case OPT_URING_MODE:
+				async_uring = 1;
+				parse_uring_mode(optarg);
+				break;
 			case 'W':
 				write_test++;
 				break;
@@ -899,6 +1554,88 @@ void parse_options(int argc, char **argv)
 			case 'b':
 				burst = parse_int(optarg);
 				break;
+			case 'Q':
+				iodepth = parse_int(optarg);
+				break;
+			case OPT_THREADS:
+				nr_threads = parse_int(optarg);
+				break;
+			case OPT_CPUS:
+				parse_cpus(optarg);
+				break;
+			case OPT_ARRIVAL:
+				parse_arrival(optarg);
+				break;
+			case OPT_SPIN:
+				spin_time = parse_time(optarg);
+				break;
+			case OPT_TIMER_SLACK:
+				timer_slack = parse_time(optarg);
+				break;
+			case OPT_CLOCK:
+				if (!strcmp(optarg, "tsc"))
+					tsc_clock = 1;
+				else if (strcmp(optarg, "monotonic"))
+					errx(1, "unknown clock: \"%s\"", optarg);
+				break;
+			case OPT_SIZE_SPLIT:
+				parse_size_split(optarg);
+				break;
+			case OPT_DISTRIBUTION:
+				parse_distribution(optarg);
+				break;
+			case OPT_RWMIX:
+				rw_mix = parse_int(optarg);
+				if (rw_mix > 100)
+					errx(1, "rwmix must be not greater than 100");
+				/* only reads with zero percent */
+				if (rw_mix > 0)
+					write_test++;
+				break;
+			case OPT_REPLAY:
+				replay_path = optarg;
+				break;
+			case OPT_TRACE:
+				trace_path = optarg;
+				break;
+			case OPT_DECODE:
+				if (strcmp(optarg, "stat") && strcmp(optarg, "csv"))
+					errx(1, "unknown trace format: \"%s\"", optarg);
+				trace_decode = optarg;
+				break;
+			case OPT_METRICS_PORT:
+				metrics_addr = optarg;
+				break;
+			case OPT_METRICS_FILE:
+				metrics_file = optarg;
+				break;
+			case OPT_VERIFY:
+				verify = 1;
+				break;
+			case OPT_COMPRESS:
+				compress_ratio = parse_ratio(optarg);
+				break;
+			case OPT_DEDUPE:
+				dedupe_ratio = parse_ratio(optarg);
+				break;
+			case OPT_MMAP:
+				use_mmap = 1;
+				break;
+			case OPT_METADATA:
+				parse_metadata(optarg);
+				break;
+			case OPT_METADATA_FILES:
+				meta_files = parse_int(optarg);
+				if (meta_files < 1)
+					errx(1, "metadata pool must have at least one file");
+				break;
+			case OPT_SYNC_PING:
+				write_test++;
+				sync_ping = 1;
+				break;
+			case OPT_CO_CORRECT:
+				co_correct = 1;
+				break;
 			case 'k':
 				keep_file = 1;
 				break;
@@ -911,14 +1648,23 @@ void parse_options(int argc, char **argv)
 
 	if (optind > argc-1)
 		errx(1, "no destination specified");
-	if (optind < argc-1)
-		errx(1, "more than one destination specified");
-	path = argv[optind];
+
+	nr_targets = argc - optind;
+	targets = calloc(nr_targets, sizeof(*targets));
+	if (!targets)
+		err(2, NULL);
+
+	for (i = 0; i < nr_targets; i++) {
+		targets[i].path = argv[optind + i];
+		targets[i].fstype = "";
+		targets[i].device = "";
+		targets[i].fd = -1;
+	}
 }
 
 #ifdef __linux__
 
-void parse_device(dev_t dev)
+void parse_device(struct target *t, dev_t dev)
 {
 	char *buf = NULL, *ptr;
 	unsigned major, minor;
@@ -927,8 +1673,8 @@ void parse_device(dev_t dev)
 	FILE *file;
 	char *real;
 
-	if (!fstatvfs(target_fd, &vfs))
-		device_size = (long long)vfs.f_frsize * vfs.f_blocks;
+	if (!fstatvfs(t->fd, &vfs))
+		t->device_size = (long long)vfs.f_frsize * vfs.f_blocks;
 
 	/* since v2.6.26 */
 	file = fopen("/proc/self/mountinfo", "r");
@@ -939,8 +1685,8 @@ void parse_device(dev_t dev)
 		if (makedev(major, minor) != dev)
 			continue;
 		ptr = strstr(buf, " - ") + 3;
-		fstype = strdup(strsep(&ptr, " "));
-		device = strdup(strsep(&ptr, " "));
+		t->fstype = strdup(strsep(&ptr, " "));
+		t->device = strdup(strsep(&ptr, " "));
 		goto out;
 	}
 old:
@@ -956,41 +1702,41 @@ old:
 		if (*buf != '/' || stat(buf, &st) || st.st_rdev != dev)
 			continue;
 		strsep(&ptr, " ");
-		fstype = strdup(strsep(&ptr, " "));
-		device = strdup(buf);
+		t->fstype = strdup(strsep(&ptr, " "));
+		t->device = strdup(buf);
 		goto out;
 	}
 out:
 	free(buf);
 	fclose(file);
-	real = realpath(device, NULL);
+	real = realpath(t->device, NULL);
 	if (real) {
-		free(device);
-		device = real;
+		free(t->device);
+		t->device = real;
 	}
 }
 
 #elif defined(__APPLE__) || defined(__OpenBSD__) \
 	|| defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
 
-void parse_device(dev_t dev)
+void parse_device(struct target *t, dev_t dev)
 {
 	struct statfs fs;
 	(void)dev;
 
-	if (statfs(path, &fs))
+	if (statfs(t->path, &fs))
 		return;
 
-	fstype = strdup(fs.f_fstypename);
-	device = strdup(fs.f_mntfromname);
-	device_size = (long long)fs.f_bsize * fs.f_blocks;
+	t->fstype = strdup(fs.f_fstypename);
+	t->device = strdup(fs.f_mntfromname);
+	t->device_size = (long long)fs.f_bsize * fs.f_blocks;
 }
 
 #elif defined(__MINGW32__)
 
-void parse_device(dev_t dev)
+void parse_device(struct target *t, dev_t dev)
 {
-	HANDLE h = (HANDLE)_get_osfhandle(target_fd);
+	HANDLE h = (HANDLE)_get_osfhandle(t->fd);
 	ULARGE_INTEGER total;
 	DWORD flags;
 	wchar_t wname[MAX_PATH + 1];
@@ -998,8 +1744,8 @@ void parse_device(dev_t dev)
 
 	(void)dev;
 
-	if (GetDiskFreeSpaceExA(path, NULL ,&total, NULL))
-		device_size = total.QuadPart;
+	if (GetDiskFreeSpaceExA(t->path, NULL ,&total, NULL))
+		t->device_size = total.QuadPart;
 
 	if (GetVolumeInformationByHandleW(h, wname, MAX_PATH,
 					  NULL, NULL, &flags,
@@ -1007,20 +1753,21 @@ void parse_device(dev_t dev)
 		size_t len;
 
 		len = wcstombs(NULL, wname, 0) + 1;
-		device = malloc(len);
-		wcstombs(device, wname, len);
+		t->device = malloc(len);
+		wcstombs(t->device, wname, len);
 
 		len = wcstombs(NULL, wtype, 0) + 1;
-		fstype = malloc(len);
-		wcstombs(fstype, wtype, len);
+		t->fstype = malloc(len);
+		wcstombs(t->fstype, wtype, len);
 	}
 }
 
 #else
 
-void parse_device(dev_t dev)
+void parse_device(struct target *t, dev_t dev)
 {
 # warning no method to get filesystem name, device and size
+	(void)t;
 	(void)dev;
 }
 
@@ -1105,7 +1852,34 @@ void sync_file(int fd)
 
 ssize_t (*make_pread) (int fd, void *buf, size_t nbytes, off_t offset) = pread;
 ssize_t (*make_pwrite) (int fd, void *buf, size_t nbytes, off_t offset) = do_pwrite;
-ssize_t (*make_request) (int fd, void *buf, size_t nbytes, off_t offset) = pread;
+
+/* request in flight, engines pass pointer to it as completion cookie */
+struct inflight {
+	long long	request;
+	long long	start;
+	long long	intended;	/* scheduled start */
+	off_t		offset;
+	size_t		size;
+	int		split;		/* index in size_split */
+	void		*buf;
+	ssize_t		result;
+	int		error;
+	int		write;
+	int		meta;		/* metadata operation */
+	bool		corrupted;	/* -verify mismatch */
+	long long	sync_time;	/* part of request time spent in flush */
+};
+
+/* queue request into engine, it will be submitted at next queue_run() */
+void (*queue_prep) (struct inflight *io);
+
+/*
+ * Submit @nr_submit queued requests and reap up to @max completions into
+ * @done, waiting for at least @nr_wait of them but not longer than @timeout
+ * nanoseconds, negative is no limit. Returns count of completions.
+ */
+int (*queue_run) (int nr_submit, int nr_wait, struct inflight **done, int max,
+		  long long timeout);
 
 #ifdef HAVE_LINUX_PREADV2
 
@@ -1157,10 +1931,10 @@ static long io_destroy(aio_context_t ctx) {
 }
 #endif
 
-aio_context_t aio_ctx;
-struct iocb aio_cb;
-struct iocb *aio_cbp = &aio_cb;
-struct io_event aio_ev;
+_Thread_local aio_context_t aio_ctx;
+_Thread_local struct iocb aio_cb;
+_Thread_local struct iocb *aio_cbp;
+_Thread_local struct io_event aio_ev;
 
 static ssize_t aio_pread(int fd, void *buf, size_t nbytes, off_t offset)
 {
@@ -1208,16 +1982,100 @@ static ssize_t aio_pwrite(int fd, void *buf, size_t nbytes, off_t offset)
 	return aio_ev.res;
 }
 
+_Thread_local struct iocb *aio_cbs;
+_Thread_local struct iocb **aio_cbps;
+_Thread_local struct io_event *aio_evs;
+_Thread_local int aio_nr_queued;
+
+/* kernel copies iocb at submission, so they could be reused right after it */
+static void aio_queue_prep(struct inflight *io)
+{
+	struct iocb *cb = &aio_cbs[aio_nr_queued++];
+
+	cb->aio_data = (uintptr_t)io;
+	cb->aio_lio_opcode = io->write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	cb->aio_fildes = target_fd;
+	cb->aio_buf = (intptr_t)io->buf;
+	cb->aio_nbytes = io->size;
+	cb->aio_offset = io->offset;
+	cb->aio_rw_flags = rw_flags;
+}
+
+static int aio_queue_run(int nr_submit, int nr_wait, struct inflight **done, int max,
+			 long long timeout)
+{
+	struct timespec ts = {
+		.tv_sec = timeout / NSEC_PER_SEC,
+		.tv_nsec = timeout % NSEC_PER_SEC,
+	};
+	int submitted = 0;
+	long ret;
+	int i;
+
+	while (submitted < nr_submit) {
+		ret = io_submit(aio_ctx, nr_submit - submitted, aio_cbps + submitted);
+		if (ret < 0)
+			err(3, "aio submit failed");
+		if (!ret)
+			errx(3, "aio submit accepted no requests");
+		submitted += ret;
+	}
+	aio_nr_queued = 0;
+
+	ret = io_getevents(aio_ctx, nr_wait, max, aio_evs,
+			   timeout < 0 ? NULL : &ts);
+	if (ret < 0) {
+		if (errno != EINTR)
+			err(3, "aio getevents failed");
+		ret = 0;
+	}
+
+	for (i = 0; i < ret; i++) {
+		struct inflight *io = (struct inflight *)(uintptr_t)aio_evs[i].data;
+
+		io->result = aio_evs[i].res < 0 ? -1 : aio_evs[i].res;
+		io->error = aio_evs[i].res < 0 ? -aio_evs[i].res : 0;
+		done[i] = io;
+	}
+
+	return ret;
+}
+
 static void aio_setup(void)
 {
+	make_pread = aio_pread;
+	make_pwrite = aio_pwrite;
+	engine = "aio";
+
+	if (iodepth > 1) {
+		queue_prep = aio_queue_prep;
+		queue_run = aio_queue_run;
+	}
+}
+
+/* context is per thread */
+static void aio_init(void)
+{
+	int i;
+
 	memset(&aio_ctx, 0, sizeof aio_ctx);
 	memset(&aio_cb, 0, sizeof aio_cb);
+	aio_cbp = &aio_cb;
 
-	if (io_setup(1, &aio_ctx))
+	if (io_setup(iodepth, &aio_ctx))
 		err(2, "aio setup failed");
 
-	make_pread = aio_pread;
-	make_pwrite = aio_pwrite;
+	if (iodepth == 1)
+		return;
+
+	aio_cbs = calloc(iodepth, sizeof(*aio_cbs));
+	aio_cbps = calloc(iodepth, sizeof(*aio_cbps));
+	aio_evs = calloc(iodepth, sizeof(*aio_evs));
+	if (!aio_cbs || !aio_cbps || !aio_evs)
+		err(2, NULL);
+
+	for (i = 0; i < iodepth; i++)
+		aio_cbps[i] = &aio_cbs[i];
 }
 
 #else /* HAVE_LINUX_ASYNC_IO */
@@ -1229,6 +2087,10 @@ static void aio_setup(void)
 #endif
 }
 
+static void aio_init(void)
+{
+}
+
 #endif /* HAVE_LINUX_ASYNC_IO */
 
 #ifdef HAVE_LINUX_IO_URING
@@ -1237,8 +2099,13 @@ int io_uring_setup(unsigned entries, struct io_uring_params *params) {
 	return (int)syscall(__NR_io_uring_setup, entries, params);
 }
 
-int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
-	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+		   void *arg, size_t argsz) {
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int io_uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
 }
 
 #define uring_add_offset(b, o) \
@@ -1253,72 +2120,287 @@ int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complet
 #define uring_load_relaxed(p) \
 	atomic_load_explicit((p), memory_order_relaxed)
 
-#define URING_QUEUE_DEPTH 1
+_Thread_local int uring_fd;
+_Thread_local bool uring_ext_arg;	/* wait accepts timeout */
 
-int uring_fd;
+_Thread_local struct io_uring_sqe *uring_sqes;
+_Thread_local struct io_uring_cqe *uring_cqes;
 
-struct io_uring_sqe *uring_sqes;
-struct io_uring_cqe *uring_cqes;
+_Thread_local unsigned *uring_sq_array;
+_Thread_local unsigned *uring_sq_mask;
+_Thread_local atomic_uint *uring_sq_tail;
+_Thread_local atomic_uint *uring_sq_flags;
 
-unsigned *uring_sq_array;
-unsigned *uring_sq_mask;
-atomic_uint *uring_sq_tail;
+_Thread_local unsigned *uring_cq_mask;
+_Thread_local atomic_uint *uring_cq_head;
+_Thread_local atomic_uint *uring_cq_tail;
 
-unsigned *uring_cq_mask;
-atomic_uint *uring_cq_head;
-atomic_uint *uring_cq_tail;
-
-static inline void uring_sq_submit(int op, int fd, void *buf, size_t nbytes, off_t offset) {
+static inline void uring_sq_submit(int op, int fd, void *buf, size_t nbytes, off_t offset,
+				   unsigned long long user_data) {
 	unsigned tail = uring_load_relaxed(uring_sq_tail);
 	unsigned index = tail & *uring_sq_mask;
 	struct io_uring_sqe *sqe = &uring_sqes[index];
 
+	/* registered file and buffer have index 0 */
+	if (uring_fixed) {
+		op = op == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		fd = 0;
+	}
+
 	sqe->opcode = op;
+	sqe->flags = uring_fixed ? IOSQE_FIXED_FILE : 0;
+	sqe->buf_index = 0;
 	sqe->fd = fd;
 	sqe->off = offset;
 	sqe->addr = (unsigned long)buf;
 	sqe->len = nbytes;
 	sqe->rw_flags = rw_flags;
+	sqe->user_data = user_data;
 
 	uring_sq_array[index] = index;
 	tail++;
 	uring_store_release(uring_sq_tail, tail);
 }
 
-static inline int uring_cq_receive(void) {
-	unsigned head = uring_load_acquire(uring_cq_head);
-	if (head == uring_load_relaxed(uring_cq_tail))
-		errx(3, "uring cq empty");
-	unsigned index = head & *uring_cq_mask;
-	struct io_uring_cqe *cqe = &uring_cqes[index];
-	int result = cqe->res;
-	head++;
-	uring_store_release(uring_cq_head, head);
-	return result;
-}
+/*
+ * Without IORING_ENTER_EXT_ARG wait is bounded by timeout request which
+ * completes with user_data 0, such completions are skipped at reaping.
+ */
+static void uring_timeout_submit(long long timeout) {
+	static _Thread_local struct __kernel_timespec ts;
+	unsigned tail = uring_load_relaxed(uring_sq_tail);
+	unsigned index = tail & *uring_sq_mask;
+	struct io_uring_sqe *sqe = &uring_sqes[index];
 
-static ssize_t uring_pread(int fd, void *buf, size_t nbytes, off_t offset) {
-	uring_sq_submit(IORING_OP_READ, fd, buf, nbytes, offset);
-	if(io_uring_enter(uring_fd, 1, 1, IORING_ENTER_GETEVENTS) < 0)
-		err(3, "io_uring_enter");
-	return uring_cq_receive();
-}
+	/* kernel might read it later with SQPOLL */
+	ts.tv_sec = timeout / NSEC_PER_SEC;
+	ts.tv_nsec = timeout % NSEC_PER_SEC;
 
-static ssize_t uring_pwrite(int fd, void *buf, size_t nbytes, off_t offset) {
-	uring_sq_submit(IORING_OP_WRITE, fd, buf, nbytes, offset);
-	if(io_uring_enter(uring_fd, 1, 1, IORING_ENTER_GETEVENTS) < 0)
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)&ts;
+	sqe->len = 1;
+	sqe->off = 1;
+	sqe->user_data = 0;
+
+	uring_sq_array[index] = index;
+	tail++;
+	uring_store_release(uring_sq_tail, tail);
+}
+
+/*
+ * With SQPOLL kernel thread picks submissions itself, syscall only wakes it.
+ * Wait for completions lasts at most @timeout nanoseconds if it is not negative.
+ */
+static int uring_enter_wait(unsigned to_submit, unsigned min_complete, long long timeout) {
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	void *arg = NULL;
+	size_t argsz = 0;
+#ifdef IORING_ENTER_EXT_ARG
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg ext = { .ts = (uintptr_t)&ts };
+#endif
+
+	if (timeout >= 0 && min_complete) {
+#ifdef IORING_ENTER_EXT_ARG
+		if (uring_ext_arg) {
+			ts.tv_sec = timeout / NSEC_PER_SEC;
+			ts.tv_nsec = timeout % NSEC_PER_SEC;
+			flags |= IORING_ENTER_EXT_ARG;
+			arg = &ext;
+			argsz = sizeof(ext);
+		} else
+#endif
+		{
+			uring_timeout_submit(timeout);
+			to_submit++;
+		}
+	}
+
+#ifdef IORING_SETUP_SQPOLL
+	/* with SQPOLL and IOPOLL poller thread reaps completions, spin on CQ */
+	if ((uring_flags & IORING_SETUP_SQPOLL) && (uring_flags & IORING_SETUP_IOPOLL))
+		min_complete = 0;
+
+	if (uring_flags & IORING_SETUP_SQPOLL) {
+		atomic_thread_fence(memory_order_seq_cst);
+		if (uring_load_relaxed(uring_sq_flags) & IORING_SQ_NEED_WAKEUP)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		else if (!min_complete)
+			return 0;
+	}
+#endif
+
+	return io_uring_enter(uring_fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete) {
+	return uring_enter_wait(to_submit, min_complete, -1);
+}
+
+static inline int uring_cq_receive(void) {
+	unsigned head = uring_load_acquire(uring_cq_head);
+
+	/* polled completions are found only when somebody polls for them */
+	while (head == uring_load_acquire(uring_cq_tail)) {
+		if (!(uring_flags & IORING_SETUP_IOPOLL))
+			errx(3, "uring cq empty");
+		if (uring_enter(0, 1) < 0 && errno != EINTR)
+			err(3, "io_uring_enter");
+	}
+
+	unsigned index = head & *uring_cq_mask;
+	struct io_uring_cqe *cqe = &uring_cqes[index];
+	int result = cqe->res;
+	head++;
+	uring_store_release(uring_cq_head, head);
+	return result;
+}
+
+static ssize_t uring_pread(int fd, void *buf, size_t nbytes, off_t offset) {
+	uring_sq_submit(IORING_OP_READ, fd, buf, nbytes, offset, 0);
+	if(uring_enter(1, 1) < 0)
+		err(3, "io_uring_enter");
+	return uring_cq_receive();
+}
+
+static ssize_t uring_pwrite(int fd, void *buf, size_t nbytes, off_t offset) {
+	uring_sq_submit(IORING_OP_WRITE, fd, buf, nbytes, offset, 0);
+	if(uring_enter(1, 1) < 0)
 		err(3, "io_uring_enter");
 	return uring_cq_receive();
 }
 
+static void uring_queue_prep(struct inflight *io) {
+	uring_sq_submit(io->write ? IORING_OP_WRITE : IORING_OP_READ,
+			target_fd, io->buf, io->size, io->offset, (uintptr_t)io);
+}
+
+/* reap all available completions, but not more than @max */
+static int uring_cq_reap(struct inflight **done, int max) {
+	unsigned head = uring_load_relaxed(uring_cq_head);
+	unsigned tail = uring_load_acquire(uring_cq_tail);
+	int nr = 0;
+
+	while (head != tail && nr < max) {
+		struct io_uring_cqe *cqe = &uring_cqes[head & *uring_cq_mask];
+		struct inflight *io = (struct inflight *)(uintptr_t)cqe->user_data;
+
+		head++;
+		if (!io)
+			continue;
+		io->result = cqe->res < 0 ? -1 : cqe->res;
+		io->error = cqe->res < 0 ? -cqe->res : 0;
+		done[nr++] = io;
+	}
+
+	uring_store_release(uring_cq_head, head);
+	return nr;
+}
+
+static int uring_queue_run(int nr_submit, int nr_wait, struct inflight **done, int max,
+			   long long timeout) {
+	long long deadline = timeout < 0 ? 0 : now() + timeout;
+	int nr = uring_cq_reap(done, max);
+
+	/* polling could return earlier than min_complete reached */
+	while (nr_submit || nr < nr_wait) {
+		unsigned min_complete = nr < nr_wait ? nr_wait - nr : 0;
+
+		if (timeout >= 0 && min_complete) {
+			timeout = deadline - now();
+			if (timeout <= 0) {
+				if (!nr_submit)
+					break;
+				min_complete = 0;
+			}
+		}
+
+		if (uring_enter_wait(nr_submit, min_complete, timeout) < 0) {
+			if (errno != EINTR && errno != ETIME)
+				err(3, "io_uring_enter");
+			if (exiting || errno == ETIME)
+				break;
+		}
+		nr_submit = 0;
+		nr += uring_cq_reap(done + nr, max - nr);
+	}
+
+	return nr;
+}
+
+static void uring_describe_mode(void) {
+	char *ptr = engine_mode, *end = engine_mode + sizeof(engine_mode);
+
+	if (uring_flags & IORING_SETUP_IOPOLL)
+		ptr += snprintf(ptr, end - ptr, ",iopoll");
+#ifdef IORING_SETUP_SQPOLL
+	if (uring_flags & IORING_SETUP_SQPOLL) {
+		if (uring_flags & IORING_SETUP_SQ_AFF)
+			ptr += snprintf(ptr, end - ptr, ",sqpoll:%d", uring_sq_cpu);
+		else
+			ptr += snprintf(ptr, end - ptr, ",sqpoll");
+	}
+#endif
+#ifdef IORING_SETUP_DEFER_TASKRUN
+	if (uring_flags & IORING_SETUP_DEFER_TASKRUN)
+		ptr += snprintf(ptr, end - ptr, ",defer");
+	else
+#endif
+#ifdef IORING_SETUP_SINGLE_ISSUER
+	if (uring_flags & IORING_SETUP_SINGLE_ISSUER)
+		ptr += snprintf(ptr, end - ptr, ",single");
+#endif
+#ifdef IORING_SETUP_COOP_TASKRUN
+	if (uring_flags & IORING_SETUP_COOP_TASKRUN)
+		ptr += snprintf(ptr, end - ptr, ",coop");
+#endif
+	if (uring_fixed)
+		ptr += snprintf(ptr, end - ptr, ",fixed");
+
+	/* drop leading comma */
+	if (engine_mode[0])
+		memmove(engine_mode, engine_mode + 1, strlen(engine_mode));
+}
+
 void uring_setup(void) {
+	/* ring polls completions itself, RWF_HIPRI is implied */
+	if (rw_flags & RWF_HIPRI) {
+		if (!direct)
+			errx(1, "polled I/O uring requires direct I/O (-D)");
+		uring_flags |= IORING_SETUP_IOPOLL;
+		rw_flags &= ~RWF_HIPRI;
+	}
+
+	make_pread = uring_pread;
+	make_pwrite = uring_pwrite;
+	queue_prep = uring_queue_prep;
+	queue_run = uring_queue_run;
+
+	engine = "uring";
+	uring_describe_mode();
+}
+
+/* ring is per thread */
+void uring_init(void) {
 	struct io_uring_params params;
 	void *sq_ptr, *cq_ptr;
 
 	memset(&params, 0, sizeof(params));
-	uring_fd = io_uring_setup(URING_QUEUE_DEPTH, &params);
-	if (uring_fd < 0)
+	params.flags = uring_flags;
+#ifdef IORING_SETUP_SQ_AFF
+	if (uring_flags & IORING_SETUP_SQ_AFF)
+		params.sq_thread_cpu = uring_sq_cpu;
+#endif
+	/* one more entry for timeout request */
+	uring_fd = io_uring_setup(iodepth + 1, &params);
+	if (uring_fd < 0) {
+		if (uring_flags)
+			err(2, "io_uring_setup failed, "
+			       "please retry without option -uring-mode");
 		err(2, "io_uring_setup");
+	}
 
 	int sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
 	int cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
@@ -1333,6 +2415,7 @@ void uring_setup(void) {
 	uring_sq_array = uring_add_offset(sq_ptr, params.sq_off.array);
 	uring_sq_tail = uring_add_offset(sq_ptr, params.sq_off.tail);
 	uring_sq_mask = uring_add_offset(sq_ptr, params.sq_off.ring_mask);
+	uring_sq_flags = uring_add_offset(sq_ptr, params.sq_off.flags);
 
 	uring_cq_head = uring_add_offset(cq_ptr, params.cq_off.head);
 	uring_cq_tail = uring_add_offset(cq_ptr, params.cq_off.tail);
@@ -1340,8 +2423,23 @@ void uring_setup(void) {
 
 	uring_cqes = uring_add_offset(cq_ptr, params.cq_off.cqes);
 
-	make_pread = uring_pread;
-	make_pwrite = uring_pwrite;
+#ifdef IORING_FEAT_EXT_ARG
+	uring_ext_arg = params.features & IORING_FEAT_EXT_ARG;
+#endif
+}
+
+/* pin buffers and target file once rather than at each request */
+void uring_register(void) {
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = size * iodepth,
+	};
+
+	if (io_uring_register(uring_fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0)
+		err(2, "io_uring register buffers failed");
+
+	if (io_uring_register(uring_fd, IORING_REGISTER_FILES, &target_fd, 1) < 0)
+		err(2, "io_uring register files failed");
 }
 
 #else /* HAVE_LINUX_IO_URING */
@@ -1351,6 +2449,14 @@ static void uring_setup(void)
 	errx(1, "asynchronous I/O uring is not supported");
 }
 
+static void uring_init(void)
+{
+}
+
+static void uring_register(void)
+{
+}
+
 #endif /* HAVE_LINUX_IO_URING */
 
 #ifdef __MINGW32__
@@ -1503,7 +2609,8 @@ void set_signal(void)
 
 #endif /* __MINGW32__ */
 
-static unsigned long long random_state[2];
+static _Thread_local unsigned long long random_state[2];
+static unsigned long long random_seed;	/* initial entropy */
 
 /* xorshift128+ */
 static inline unsigned long long random64(void)
@@ -1527,208 +2634,1095 @@ static unsigned long long random64_seed(void)
 	return result ^ (result >> 31);
 }
 
+/*
+ * Buffers are filled by independent xorshift128+ streams: word i of each
+ * block of RANDOM_LANES words comes from lane i. All implementations give
+ * the same data, thus it is deterministic for given entropy.
+ */
+#define RANDOM_LANES	4
+
+static _Thread_local unsigned long long random_lanes[2][RANDOM_LANES];
+
+static void random_fill_scalar(unsigned long long *ptr, size_t blocks)
+{
+	unsigned long long s1, s0;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < RANDOM_LANES; i++) {
+			s1 = random_lanes[0][i];
+			s0 = random_lanes[1][i];
+			random_lanes[0][i] = s0;
+			s1 ^= s1 << 23;
+			random_lanes[1][i] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+			*ptr++ = random_lanes[1][i] + s0;
+		}
+	}
+}
+
+#ifdef HAVE_SSE2
+
+static inline __m128i random_step_sse2(__m128i *a, __m128i *b)
+{
+	__m128i s1 = *a, s0 = *b;
+
+	*a = s0;
+	s1 = _mm_xor_si128(s1, _mm_slli_epi64(s1, 23));
+	*b = _mm_xor_si128(_mm_xor_si128(s1, s0),
+			   _mm_xor_si128(_mm_srli_epi64(s1, 17),
+					 _mm_srli_epi64(s0, 26)));
+	return _mm_add_epi64(*b, s0);
+}
+
+static void random_fill_sse2(unsigned long long *ptr, size_t blocks)
+{
+	__m128i a0 = _mm_loadu_si128((__m128i *)random_lanes[0]);
+	__m128i a1 = _mm_loadu_si128((__m128i *)(random_lanes[0] + 2));
+	__m128i b0 = _mm_loadu_si128((__m128i *)random_lanes[1]);
+	__m128i b1 = _mm_loadu_si128((__m128i *)(random_lanes[1] + 2));
+
+	while (blocks--) {
+		_mm_storeu_si128((__m128i *)ptr, random_step_sse2(&a0, &b0));
+		_mm_storeu_si128((__m128i *)(ptr + 2), random_step_sse2(&a1, &b1));
+		ptr += RANDOM_LANES;
+	}
+
+	_mm_storeu_si128((__m128i *)random_lanes[0], a0);
+	_mm_storeu_si128((__m128i *)(random_lanes[0] + 2), a1);
+	_mm_storeu_si128((__m128i *)random_lanes[1], b0);
+	_mm_storeu_si128((__m128i *)(random_lanes[1] + 2), b1);
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_AVX2
+
+__attribute__((target("avx2")))
+static void random_fill_avx2(unsigned long long *ptr, size_t blocks)
+{
+	__m256i a = _mm256_loadu_si256((__m256i *)random_lanes[0]);
+	__m256i b = _mm256_loadu_si256((__m256i *)random_lanes[1]);
+	__m256i s1, s0;
+
+	while (blocks--) {
+		s1 = a;
+		s0 = b;
+		a = s0;
+		s1 = _mm256_xor_si256(s1, _mm256_slli_epi64(s1, 23));
+		b = _mm256_xor_si256(_mm256_xor_si256(s1, s0),
+				     _mm256_xor_si256(_mm256_srli_epi64(s1, 17),
+						      _mm256_srli_epi64(s0, 26)));
+		_mm256_storeu_si256((__m256i *)ptr, _mm256_add_epi64(b, s0));
+		ptr += RANDOM_LANES;
+	}
+
+	_mm256_storeu_si256((__m256i *)random_lanes[0], a);
+	_mm256_storeu_si256((__m256i *)random_lanes[1], b);
+}
+
+#endif /* HAVE_AVX2 */
+
+#ifdef HAVE_NEON
+
+static inline uint64x2_t random_step_neon(uint64x2_t *a, uint64x2_t *b)
+{
+	uint64x2_t s1 = *a, s0 = *b;
+
+	*a = s0;
+	s1 = veorq_u64(s1, vshlq_n_u64(s1, 23));
+	*b = veorq_u64(veorq_u64(s1, s0),
+		       veorq_u64(vshrq_n_u64(s1, 17), vshrq_n_u64(s0, 26)));
+	return vaddq_u64(*b, s0);
+}
+
+static void random_fill_neon(unsigned long long *ptr, size_t blocks)
+{
+	uint64_t *lanes0 = (uint64_t *)random_lanes[0];
+	uint64_t *lanes1 = (uint64_t *)random_lanes[1];
+	uint64_t *out = (uint64_t *)ptr;
+	uint64x2_t a0 = vld1q_u64(lanes0), a1 = vld1q_u64(lanes0 + 2);
+	uint64x2_t b0 = vld1q_u64(lanes1), b1 = vld1q_u64(lanes1 + 2);
+
+	while (blocks--) {
+		vst1q_u64(out, random_step_neon(&a0, &b0));
+		vst1q_u64(out + 2, random_step_neon(&a1, &b1));
+		out += RANDOM_LANES;
+	}
+
+	vst1q_u64(lanes0, a0);
+	vst1q_u64(lanes0 + 2, a1);
+	vst1q_u64(lanes1, b0);
+	vst1q_u64(lanes1 + 2, b1);
+}
+
+#endif /* HAVE_NEON */
+
+static void (*random_fill)(unsigned long long *ptr, size_t blocks) =
+	random_fill_scalar;
+
+/* lanes of thread are seeded from its main stream */
+static void random_lanes_init(void)
+{
+	int i;
+
+	for (i = 0; i < RANDOM_LANES; i++) {
+		random_lanes[0][i] = random64();
+		random_lanes[1][i] = random64();
+	}
+}
+
 static void random_init(void)
 {
 	if (!random_entropy)
 		random_entropy = now();
+	random_seed = random_entropy;
 	random_state[0] = random64_seed();
 	random_state[1] = random64_seed();
 	(void)random64();
 	(void)random64();
+	random_lanes_init();
+
+#ifdef HAVE_SSE2
+	random_fill = random_fill_sse2;
+#endif
+#ifdef HAVE_NEON
+	random_fill = random_fill_neon;
+#endif
+#ifdef HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		random_fill = random_fill_avx2;
+#endif
 }
 
 static void random_memory(void *buf, size_t len)
 {
-	unsigned long long *ptr = buf;
-	size_t words = len >> 3;
+	unsigned long long *ptr = buf, last[RANDOM_LANES];
+	size_t blocks = len / sizeof(last);
 
-	while (words--)
-		*ptr++ = random64();
+	random_fill(ptr, blocks);
 
-	if (len & 7) {
-		unsigned long long last = random64();
-		memcpy(ptr, &last, len & 7);
+	len -= blocks * sizeof(last);
+	if (len) {
+		random_fill(last, 1);
+		memcpy(ptr + blocks * RANDOM_LANES, last, len);
 	}
 }
 
-struct statistics {
-	long long start, finish, load_time;
-	long long count, valid, too_slow, too_fast, failed;
-	long long min, max;
-	double sum, sum2, avg, mdev;
-	double speed, iops, load_speed, load_iops;
-	long long size, load_size;
-};
+/*
+ * Data pool for -compress and -dedupe is generated once, each block has
+ * random head and zero tail. Block of data with index N is copy of pool
+ * block stamped with N / dedupe_ratio, thus each dedupe_ratio consecutive
+ * blocks are equal.
+ */
+#define POOL_BLOCK	4096
+#define POOL_SIZE	(4 << 20)
 
-static void start_statistics(struct statistics *s, unsigned long long start) {
-	memset(s, 0, sizeof(*s));
-	s->min = LLONG_MAX;
-	s->max = LLONG_MIN;
-	s->start = start;
-}
+static char *data_pool;
+static _Thread_local unsigned long long data_pool_blocks;
+static _Thread_local unsigned long long data_pool_salt;
 
-static int add_statistics(struct statistics *s, ssize_t ret, long long val) {
-	s->count++;
-	if (ret <= 0) {
-		s->failed++;
-	} else if (request <= warmup_request) {
-		notice = "warmup";
-	} else if (val < min_valid_time) {
-		notice = "too fast";
-		s->too_fast++;
-	} else if (val > max_valid_time) {
-		notice = "too slow";
-		s->too_slow++;
-	} else {
-		s->valid++;
-		s->sum += val;
-		s->sum2 += (double)val * val;
-		if (val < s->min)
-			s->min = val;
-		if (val > s->max)
-			s->max = val;
+static void pool_init(void)
+{
+	size_t head = POOL_BLOCK;
+	size_t pos;
 
-		notice = NULL;
-		if (s->valid > 5) {
-			long long avg = s->sum / s->valid;
-			if (val * 2 < avg)
-				notice = "fast";
-			else if (val > avg * 2)
-				notice = "slow";
-		}
+	if (compress_ratio)
+		head = POOL_BLOCK / compress_ratio;
 
-		return 1;
+	if (posix_memalign((void **)&data_pool, 0x1000, POOL_SIZE))
+		errx(2, "buffer allocation failed");
+
+	for (pos = 0; pos < POOL_SIZE; pos += POOL_BLOCK) {
+		random_memory(data_pool + pos, head);
+		memset(data_pool + pos + head, 0, POOL_BLOCK - head);
 	}
+}
 
-	return 0;
+static void pool_block(char *ptr, size_t len, unsigned long long block,
+		       unsigned long long salt)
+{
+	unsigned long long stamp;
+
+	/* fractional ratio makes runs of floor and ceil of it */
+	if (dedupe_ratio)
+		block = (unsigned long long)(block / dedupe_ratio);
+	memcpy(ptr, data_pool + block % (POOL_SIZE / POOL_BLOCK) * POOL_BLOCK,
+	       len);
+	stamp = block + salt;
+	if (len >= sizeof(stamp))
+		memcpy(ptr, &stamp, sizeof(stamp));
 }
 
-static void merge_statistics(struct statistics *s, struct statistics *o) {
-	s->count += o->count;
-	s->too_fast += o->too_fast;
-	s->too_slow += o->too_slow;
-	s->failed += o->failed;
-	if (o->valid) {
-		s->valid += o->valid;
-		s->sum += o->sum;
-		s->sum2 += o->sum2;
-		if (o->min < s->min)
-			s->min = o->min;
-		if (o->max > s->max)
-			s->max = o->max;
+static void pool_memory(void *buf, size_t len)
+{
+	char *ptr = buf;
+	size_t chunk;
+
+	if (!data_pool_salt)
+		data_pool_salt = random64();
+
+	while (len) {
+		chunk = len < POOL_BLOCK ? len : POOL_BLOCK;
+		pool_block(ptr, chunk, data_pool_blocks++, data_pool_salt);
+		ptr += chunk;
+		len -= chunk;
 	}
 }
 
-static void finish_statistics(struct statistics *s, unsigned long long finish) {
-	s->finish = finish;
-	s->load_time = finish - s->start;
+/* data for write requests */
+static void write_memory(void *buf, size_t len)
+{
+	if (data_pool)
+		pool_memory(buf, len);
+	else
+		random_memory(buf, len);
+}
 
-	if (s->valid) {
-		s->avg = s->sum / s->valid;
-		s->mdev = sqrt(s->sum2 / s->valid - s->avg * s->avg);
-	} else {
-		s->min = 0;
-		s->max = 0;
-	}
+/* CRC32C (Castagnoli), reflected polynomial */
+#define CRC32C_POLY	0x82F63B78
 
-	if (s->sum)
-		s->iops = (double)NSEC_PER_SEC * s->valid / s->sum;
+static uint32_t crc32c_table[256];
 
-	if (s->load_time)
-		s->load_iops = (double)NSEC_PER_SEC * s->count / s->load_time;
+static uint32_t crc32c_soft(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
 
-	s->speed = s->iops * size;
-	s->load_speed = s->load_iops * size;
-	s->size = s->valid * size;
-	s->load_size = s->count * size;
+	while (len--)
+		crc = crc32c_table[(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+	return crc;
 }
 
-static void dump_statistics(struct statistics *s) {
-	printf("%llu %.0f %.0f %.0f %llu %.0f %llu %.0f %llu %llu\n",
-	       s->valid, s->sum, s->iops, s->speed,
-	       s->min, s->avg, s->max, s->mdev,
-	       s->count, s->load_time);
-}
+#ifdef HAVE_CRC32C_SSE42
 
-static void json_request(long long io_size, long long io_time, int valid)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
 {
-	update_timestamp();
+	const uint8_t *ptr = buf;
+	unsigned long long val, crc64 = crc;
 
-	printf("%s{\n"
-	       "  \"timestamp\": %s,\n"
-	       "  \"localtime\": \"%s\",\n"
-	       "  \"target\": {\n"
-	       "    \"path\": \"%s\",\n"
-	       "    \"fstype\": \"%s\",\n"
-	       "    \"device\": \"%s\",\n"
-	       "    \"device_size\": %lld\n"
-	       "  },\n"
-	       "  \"io\": {\n"
-	       "    \"request\": %lld,\n"
-	       "    \"operation\": \"%s\",\n"
-	       "    \"offset\": %lld,\n"
-	       "    \"size\": %lld,\n"
-	       "    \"time\": %llu,\n"
-	       "    \"ignored\": %s,\n"
-	       "    \"notice\": \"%s\"\n"
-	       "  }\n"
-	       "}",
-	       json_line++ ? "," : "",
-	       timestamp_str,
-	       localtime_str,
-	       path,
-	       fstype,
-	       device,
-	       device_size,
-	       request,
-	       write_test ? "write" : "read",
-	       (long long)offset + woffset,
-	       io_size,
-	       io_time,
-	       valid ? "false" : "true",
-	       notice ? notice : "");
+	for (; len >= 8; len -= 8, ptr += 8) {
+		memcpy(&val, ptr, 8);
+		crc64 = _mm_crc32_u64(crc64, val);
+	}
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *ptr++);
+	return crc;
 }
 
-static void json_statistics(struct statistics *s)
+#endif /* HAVE_CRC32C_SSE42 */
+
+#ifdef HAVE_CRC32C_ARM
+
+static uint32_t crc32c_arm(uint32_t crc, const void *buf, size_t len)
 {
-	update_timestamp();
+	const uint8_t *ptr = buf;
+	uint64_t val;
 
-	printf("%s{\n"
-	       "  \"timestamp\": %s,\n"
-	       "  \"localtime\": \"%s\",\n"
-	       "  \"target\": {\n"
-	       "    \"path\": \"%s\",\n"
+	for (; len >= 8; len -= 8, ptr += 8) {
+		memcpy(&val, ptr, 8);
+		crc = __crc32cd(crc, val);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *ptr++);
+	return crc;
+}
+
+#endif /* HAVE_CRC32C_ARM */
+
+static uint32_t (*crc32c_update)(uint32_t crc, const void *buf, size_t len) =
+	crc32c_soft;
+
+static uint32_t crc32c(const void *buf, size_t len)
+{
+	return ~crc32c_update(~0u, buf, len);
+}
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = crc;
+	}
+
+#ifdef HAVE_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_update = crc32c_sse42;
+#endif
+#ifdef HAVE_CRC32C_ARM
+	crc32c_update = crc32c_arm;
+#endif
+}
+
+/*
+ * With -verify each block starts with header, checksum covers
+ * the rest of block including other fields of header. Target keeps
+ * byte per block with tag of last write in this run, blocks with
+ * zero tag are not known yet and not checked.
+ */
+#define VERIFY_BLOCK	4096
+#define VERIFY_MAGIC	"IOPV"
+
+struct verify_header {
+	char		magic[4];
+	uint32_t	crc;
+	uint64_t	offset;
+	uint64_t	sequence;	/* write request, zero for preparation */
+	uint64_t	seed;		/* entropy of writer */
+	uint64_t	nonce;		/* unique for run, unlike seed */
+};
+
+#define VERIFY_DATA	offsetof(struct verify_header, offset)
+
+atomic_ullong verify_sequence;
+static unsigned long long verify_nonce;
+
+/* fixed -entropy repeats seed, stale blocks must differ anyway */
+static void verify_init(void)
+{
+#ifdef __NR_getrandom
+	if (syscall(__NR_getrandom, &verify_nonce, sizeof(verify_nonce), 0) ==
+	    sizeof(verify_nonce) && verify_nonce)
+		return;
+#endif
+	verify_nonce = system_now() ^ ((unsigned long long)getpid() << 32);
+	verify_nonce ^= verify_nonce >> 29;
+	verify_nonce *= 0xbf58476d1ce4e5b9ULL;
+	verify_nonce ^= verify_nonce >> 32;
+}
+
+static inline unsigned char verify_tag(unsigned long long sequence)
+{
+	return sequence % 255 + 1;
+}
+
+static void verify_setup(struct target *t, bool temporary)
+{
+	if (!temporary && !write_test)
+		errx(1, "verify requires temporary file or writes, "
+			"data at \"%s\" was not written by ioping", t->path);
+
+	t->verify_map = calloc((t->wsize + VERIFY_BLOCK - 1) / VERIFY_BLOCK, 1);
+	if (!t->verify_map)
+		errx(2, "buffer allocation failed");
+}
+
+/* blocks after failure or short write have unknown content */
+static void verify_written(struct inflight *io, size_t len)
+{
+	struct verify_header *hdr = (struct verify_header *)io->buf;
+	unsigned char *map = target->verify_map +
+		(io->offset - offset) / VERIFY_BLOCK;
+	size_t pos;
+
+	for (pos = 0; pos + VERIFY_BLOCK <= io->size; pos += VERIFY_BLOCK)
+		*map++ = pos + VERIFY_BLOCK <= len ?
+			 verify_tag(hdr->sequence) : 0;
+}
+
+static void verify_stamp(void *buf, off_t start, size_t len,
+			 unsigned long long sequence)
+{
+	struct verify_header *hdr;
+	size_t pos;
+
+	for (pos = 0; pos + VERIFY_BLOCK <= len; pos += VERIFY_BLOCK) {
+		hdr = (struct verify_header *)((char *)buf + pos);
+		memcpy(hdr->magic, VERIFY_MAGIC, sizeof(hdr->magic));
+		hdr->offset = start + pos;
+		hdr->sequence = sequence;
+		hdr->seed = random_seed;
+		hdr->nonce = verify_nonce;
+		hdr->crc = crc32c((char *)hdr + VERIFY_DATA,
+				  VERIFY_BLOCK - VERIFY_DATA);
+	}
+}
+
+/* returns false and reports first corrupted block */
+static bool verify_check(void *buf, off_t start, size_t len)
+{
+	unsigned char *map = target->verify_map + (start - offset) / VERIFY_BLOCK;
+	struct verify_header *hdr;
+	unsigned char tag;
+	const char *reason;
+	char message[256];
+	size_t pos;
+
+	for (pos = 0; pos + VERIFY_BLOCK <= len; pos += VERIFY_BLOCK) {
+		tag = map[pos / VERIFY_BLOCK];
+		if (!tag)
+			continue;
+
+		hdr = (struct verify_header *)((char *)buf + pos);
+		if (memcmp(hdr->magic, VERIFY_MAGIC, sizeof(hdr->magic)))
+			reason = "no header";
+		else if (hdr->crc != crc32c((char *)hdr + VERIFY_DATA,
+					    VERIFY_BLOCK - VERIFY_DATA))
+			reason = "checksum mismatch";
+		else if (hdr->offset != (uint64_t)(start + pos))
+			reason = "misplaced block";
+		else if (hdr->nonce != verify_nonce)
+			reason = "stale block from other run";
+		else if (verify_tag(hdr->sequence) != tag)
+			reason = "lost write";
+		else
+			continue;
+
+		snprintf(message, sizeof(message),
+			 "data corruption at offset %lld: %s, header: "
+			 "offset %llu, request %llu, entropy %llu",
+			 (long long)(start + pos), reason,
+			 (unsigned long long)hdr->offset,
+			 (unsigned long long)hdr->sequence,
+			 (unsigned long long)hdr->seed);
+		if (!ignore_error)
+			errx(3, "%s", message);
+		warnx("%s", message);
+		return false;
+	}
+
+	return true;
+}
+
+/* uniform in [0, 1) */
+static inline double random_double(void)
+{
+	return (random64() >> 11) * 0x1.0p-53;
+}
+
+/* exponentially distributed value with given mean */
+static long long random_exp(long long mean)
+{
+	return -log1p(-random_double()) * mean;
+}
+
+/*
+ * Zipf ranks by rejection-inversion sampling: O(1) expected time per sample
+ * without tables, see W. Hormann, G. Derflinger "Rejection-inversion to
+ * generate variates from monotone discrete distributions" (1996).
+ */
+static double zipf_hx1, zipf_s;
+
+static double zipf_helper1(double x)
+{
+	/* log1p(x) / x */
+	if (fabs(x) > 1e-8)
+		return log1p(x) / x;
+	return 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x)
+{
+	/* expm1(x) / x */
+	if (fabs(x) > 1e-8)
+		return expm1(x) / x;
+	return 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double zipf_h(double x)
+{
+	return exp(-dist_param * log(x));
+}
+
+static double zipf_hint(double x)
+{
+	double lx = log(x);
+
+	return zipf_helper2((1 - dist_param) * lx) * lx;
+}
+
+static double zipf_hint_inv(double x)
+{
+	double t = x * (1 - dist_param);
+
+	if (t < -1)
+		t = -1;
+	return exp(zipf_helper1(t) * x);
+}
+
+/* rank from 0, most popular first */
+static unsigned long long zipf_rank(struct target *t)
+{
+	for (;;) {
+		double u = t->zipf_hn + random_double() * (zipf_hx1 - t->zipf_hn);
+		double x = zipf_hint_inv(u);
+		unsigned long long k = x + 0.5;
+
+		if (k < 1)
+			k = 1;
+		else if (k > t->blocks)
+			k = t->blocks;
+
+		if (k - x <= zipf_s || u >= zipf_hint(k + 0.5) - zipf_h(k))
+			return k - 1;
+	}
+}
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+	while (b) {
+		unsigned long long r = a % b;
+		a = b;
+		b = r;
+	}
+	return a;
+}
+
+static void init_distribution(struct target *t)
+{
+	t->blocks = t->wsize / min_size;
+
+	if (distribution == DIST_ZIPF) {
+		zipf_hx1 = zipf_hint(1.5) - 1;
+		zipf_s = 2 - zipf_hint_inv(zipf_hint(2.5) - zipf_h(2));
+		t->zipf_hn = zipf_hint(t->blocks + 0.5);
+	}
+
+	/* multiplier coprime with count of blocks gives permutation */
+	t->spread = t->blocks * 0.6180339887498949;
+	while (t->spread > 1 && gcd(t->spread, t->blocks) != 1)
+		t->spread--;
+	if (!t->spread)
+		t->spread = 1;
+}
+
+/* scatter popular ranks over working set */
+static unsigned long long spread_block(struct target *t, unsigned long long rank)
+{
+#ifdef __SIZEOF_INT128__
+	__extension__ typedef unsigned __int128 u128;
+
+	return (u128)rank * t->spread % t->blocks;
+#else
+	return rank * t->spread % t->blocks;
+#endif
+}
+
+static unsigned long long random_block(struct target *t)
+{
+	unsigned long long hot, rank;
+
+	switch (distribution) {
+	case DIST_ZIPF:
+		return spread_block(t, zipf_rank(t));
+	case DIST_PARETO:
+		rank = t->blocks * pow(random_double(), dist_pareto_pow);
+		if (rank >= t->blocks)
+			rank = t->blocks - 1;
+		return spread_block(t, rank);
+	case DIST_HOTCOLD:
+		hot = t->blocks * dist_hot_size;
+		if (!hot)
+			hot = 1;
+		if (hot >= t->blocks || random_double() < dist_hot_requests)
+			return random64() % hot;
+		return hot + random64() % (t->blocks - hot);
+	default:
+		return random64() % t->blocks;
+	}
+}
+
+static inline int hist_index(long long val) {
+	int shift;
+
+	if (val < 2 * HIST_SUB_COUNT)
+		return val < 0 ? 0 : val;
+
+	if (val >= 1ll << HIST_MAX_BITS)
+		return HIST_SIZE - 1;
+
+	shift = 63 - __builtin_clzll(val) - HIST_SUB_BITS;
+	return (shift * HIST_SUB_COUNT) + (val >> shift);
+}
+
+/* middle of bucket */
+static long long hist_value(int index) {
+	int shift = index / HIST_SUB_COUNT - 1;
+
+	if (shift < 1)
+		return index;
+
+	return ((long long)(index - shift * HIST_SUB_COUNT) << shift) +
+		(1ll << (shift - 1));
+}
+
+/* buckets in use are between min and max */
+static void hist_clear(struct statistics *s) {
+	int first, last;
+
+	if (!s->hist || !s->valid)
+		return;
+	first = hist_index(s->min);
+	last = hist_index(s->max);
+	memset(s->hist + first, 0, (last - first + 1) * sizeof(*s->hist));
+}
+
+static void hist_alloc(struct statistics *s) {
+	if (s->hist)
+		return;
+	s->hist = calloc(HIST_SIZE, sizeof(*s->hist));
+	if (!s->hist)
+		err(2, NULL);
+}
+
+static void start_statistics(struct statistics *s, unsigned long long start) {
+	long long *hist = s->hist;
+
+	hist_clear(s);
+	memset(s, 0, sizeof(*s));
+	s->hist = hist;
+	s->min = LLONG_MAX;
+	s->max = LLONG_MIN;
+	s->sched_min = LLONG_MAX;
+	s->sched_max = LLONG_MIN;
+	s->start = start;
+}
+
+static void add_latency(struct statistics *s, long long val) {
+	s->valid++;
+	s->sum += val;
+	s->sum2 += (double)val * val;
+	if (val < s->min)
+		s->min = val;
+	if (val > s->max)
+		s->max = val;
+	if (s->hist)
+		s->hist[hist_index(val)]++;
+}
+
+static int add_statistics(struct statistics *s, long long req,
+			  long long bytes, ssize_t ret, long long val) {
+	s->count++;
+	s->load_size += bytes;
+	if (ret <= 0) {
+		s->failed++;
+	} else if (req <= warmup_request) {
+		notice = "warmup";
+	} else if (val < min_valid_time) {
+		notice = "too fast";
+		s->too_fast++;
+	} else if (val > max_valid_time) {
+		notice = "too slow";
+		s->too_slow++;
+	} else {
+		add_latency(s, val);
+		s->size += bytes;
+
+		notice = NULL;
+		if (s->valid > 5) {
+			long long avg = s->sum / s->valid;
+			if (val * 2 < avg)
+				notice = "fast";
+			else if (val > avg * 2)
+				notice = "slow";
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Coordinated omission: stalled request delays following ones, which never
+ * get issued in time and disappear from statistics. Account requests which
+ * should have been issued while this one was in flight, as HdrHistogram does.
+ */
+static void add_corrected(struct statistics *s, long long val) {
+	long long missed;
+
+	add_latency(s, val);
+
+	/* open-loop arrivals are never skipped, delay is already counted */
+	if (arrival != ARRIVAL_FIXED)
+		return;
+
+	for (missed = val - co_interval; missed > 0; missed -= co_interval)
+		add_latency(s, missed);
+}
+
+static void add_schedule(struct statistics *s, long long lag) {
+	s->sched_count++;
+	s->sched_sum += lag;
+	if (lag < s->sched_min)
+		s->sched_min = lag;
+	if (lag > s->sched_max)
+		s->sched_max = lag;
+}
+
+static void merge_statistics(struct statistics *s, struct statistics *o) {
+	int i, last;
+
+	s->count += o->count;
+	s->size += o->size;
+	s->load_size += o->load_size;
+	s->too_fast += o->too_fast;
+	s->too_slow += o->too_slow;
+	s->failed += o->failed;
+	s->corrupted += o->corrupted;
+	if (o->valid) {
+		s->valid += o->valid;
+		s->sum += o->sum;
+		s->sum2 += o->sum2;
+		if (o->min < s->min)
+			s->min = o->min;
+		if (o->max > s->max)
+			s->max = o->max;
+		if (s->hist && o->hist) {
+			last = hist_index(o->max);
+			for (i = hist_index(o->min); i <= last; i++)
+				s->hist[i] += o->hist[i];
+		}
+	}
+	if (o->sched_count) {
+		s->sched_count += o->sched_count;
+		s->sched_sum += o->sched_sum;
+		if (o->sched_min < s->sched_min)
+			s->sched_min = o->sched_min;
+		if (o->sched_max > s->sched_max)
+			s->sched_max = o->sched_max;
+	}
+}
+
+static void finish_percentiles(struct statistics *s) {
+	long long count = 0;
+	unsigned p = 0;
+	int i;
+
+	if (!s->hist)
+		return;
+
+	for (i = hist_index(s->min); i < HIST_SIZE && p < NR_PERCENTILES; i++) {
+		count += s->hist[i];
+		while (p < NR_PERCENTILES &&
+		       count >= ceil(s->valid * percentiles[p] / 100)) {
+			long long val = hist_value(i);
+
+			/* bucket might be wider than whole range */
+			if (val < s->min)
+				val = s->min;
+			if (val > s->max)
+				val = s->max;
+			s->percentile[p++] = val;
+		}
+	}
+}
+
+static void finish_statistics(struct statistics *s, unsigned long long finish) {
+	s->finish = finish;
+	s->load_time = finish - s->start;
+
+	if (s->valid) {
+		s->avg = s->sum / s->valid;
+		s->mdev = sqrt(s->sum2 / s->valid - s->avg * s->avg);
+		finish_percentiles(s);
+	} else {
+		s->min = 0;
+		s->max = 0;
+	}
+
+	if (s->sched_count) {
+		s->sched_avg = s->sched_sum / s->sched_count;
+	} else {
+		s->sched_min = 0;
+		s->sched_max = 0;
+	}
+
+	/* with several requests in flight latencies overlap, count real time */
+	if (iodepth > 1 || nr_threads > 1) {
+		if (s->load_time)
+			s->iops = (double)NSEC_PER_SEC * s->valid / s->load_time;
+	} else if (s->sum)
+		s->iops = (double)NSEC_PER_SEC * s->valid / s->sum;
+
+	if (s->load_time)
+		s->load_iops = (double)NSEC_PER_SEC * s->count / s->load_time;
+
+	/* requests might have different sizes */
+	if (s->valid)
+		s->speed = s->iops * s->size / s->valid;
+	if (s->count)
+		s->load_speed = s->load_iops * s->load_size / s->count;
+}
+
+static bool split_sync(void);
+
+/* histograms are allocated only for reported groups */
+static void start_statset(struct statset *s, long long start) {
+	int i;
+
+	hist_alloc(&s->all);
+	hist_alloc(&s->op[0]);
+	hist_alloc(&s->op[1]);
+	if (co_correct)
+		hist_alloc(&s->co);
+	if (split_sync()) {
+		hist_alloc(&s->data);
+		hist_alloc(&s->sync);
+	}
+	for (i = 0; i < nr_size_split; i++)
+		hist_alloc(&s->split[i]);
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			hist_alloc(&s->meta[i]);
+
+	start_statistics(&s->all, start);
+	start_statistics(&s->co, start);
+	start_statistics(&s->op[0], start);
+	start_statistics(&s->op[1], start);
+	start_statistics(&s->data, start);
+	start_statistics(&s->sync, start);
+	for (i = 0; i < nr_size_split; i++)
+		start_statistics(&s->split[i], start);
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			start_statistics(&s->meta[i], start);
+}
+
+static void merge_statset(struct statset *s, struct statset *o) {
+	int i;
+
+	merge_statistics(&s->all, &o->all);
+	merge_statistics(&s->co, &o->co);
+	merge_statistics(&s->op[0], &o->op[0]);
+	merge_statistics(&s->op[1], &o->op[1]);
+	merge_statistics(&s->data, &o->data);
+	merge_statistics(&s->sync, &o->sync);
+	for (i = 0; i < nr_size_split; i++)
+		merge_statistics(&s->split[i], &o->split[i]);
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			merge_statistics(&s->meta[i], &o->meta[i]);
+}
+
+static void finish_statset(struct statset *s, long long finish) {
+	int i;
+
+	finish_statistics(&s->all, finish);
+	finish_statistics(&s->co, finish);
+	finish_statistics(&s->op[0], finish);
+	finish_statistics(&s->op[1], finish);
+	finish_statistics(&s->data, finish);
+	finish_statistics(&s->sync, finish);
+	for (i = 0; i < nr_size_split; i++)
+		finish_statistics(&s->split[i], finish);
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			finish_statistics(&s->meta[i], finish);
+}
+
+/* write and cache flush are reported separately */
+static bool split_sync(void)
+{
+	return write_test && !cached && !sync_ping;
+}
+
+/* reads and writes are reported separately */
+static bool mixed_rw(void)
+{
+	return write_read_test || rw_mix >= 0 || (replay_path && write_test);
+}
+
+static void dump_latency(struct statistics *s) {
+	unsigned i;
+
+	printf(" %llu %.0f %llu", s->valid, s->avg, s->max);
+	for (i = 0; i < NR_PERCENTILES; i++)
+		printf(" %llu", s->percentile[i]);
+}
+
+static void dump_statistics(struct statset *ss) {
+	struct statistics *s = &ss->all;
+	unsigned i;
+
+	printf("%llu %.0f %.0f %.0f %llu %.0f %llu %.0f %llu %llu",
+	       s->valid, s->sum, s->iops, s->speed,
+	       s->min, s->avg, s->max, s->mdev,
+	       s->count, s->load_time);
+	for (i = 0; i < NR_PERCENTILES; i++)
+		printf(" %llu", s->percentile[i]);
+	if (co_correct)
+		dump_latency(&ss->co);
+	if (mixed_rw()) {
+		dump_latency(&ss->op[0]);
+		dump_latency(&ss->op[1]);
+	}
+	for (i = 0; i < (unsigned)nr_size_split; i++)
+		dump_latency(&ss->split[i]);
+	if (split_sync()) {
+		dump_latency(&ss->data);
+		dump_latency(&ss->sync);
+	}
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			dump_latency(&ss->meta[i]);
+	if (verify)
+		printf(" %llu", s->corrupted);
+	printf("\n");
+}
+
+static void json_request(struct inflight *io, long long io_size,
+			 long long io_time, int valid)
+{
+	update_timestamp();
+
+	printf("%s{\n"
+	       "  \"timestamp\": %s,\n"
+	       "  \"localtime\": \"%s\",\n"
+	       "  \"target\": {\n"
+	       "    \"path\": \"%s\",\n"
 	       "    \"fstype\": \"%s\",\n"
 	       "    \"device\": \"%s\",\n"
 	       "    \"device_size\": %lld\n"
 	       "  },\n"
-	       "  \"stat\": {\n"
-	       "    \"count\": %llu,\n"
-	       "    \"size\": %llu,\n"
-	       "    \"time\": %.0f,\n"
-	       "    \"iops\": %f,\n"
-	       "    \"bps\": %.0f,\n"
-	       "    \"min\": %llu,\n"
-	       "    \"avg\": %.0f,\n"
-	       "    \"max\": %llu,\n"
-	       "    \"mdev\": %.0f\n"
+	       "  \"io\": {\n"
+	       "    \"request\": %lld,\n"
+	       "    \"operation\": \"%s\",\n"
+	       "    \"offset\": %lld,\n"
+	       "    \"size\": %lld,\n"
+	       "    \"time\": %llu,\n"
+	       "    \"ignored\": %s,\n"
+	       "    \"notice\": \"%s\"\n"
+	       "  }\n"
+	       "}",
+	       json_line++ ? "," : "",
+	       timestamp_str,
+	       localtime_str,
+	       target->path,
+	       target->fstype,
+	       target->device,
+	       target->device_size,
+	       io->request,
+	       nr_meta_ops ? meta_names[io->meta] :
+			io->write ? "write" : "read",
+	       (long long)io->offset,
+	       io_size,
+	       io_time,
+	       valid ? "false" : "true",
+	       notice ? notice : "");
+}
+
+static void json_operation(const char *name, struct statistics *s)
+{
+	printf("  \"%s\": {\n"
+	       "    \"count\": %llu,\n"
+	       "    \"size\": %llu,\n"
+	       "    \"time\": %.0f,\n"
+	       "    \"iops\": %f,\n"
+	       "    \"bps\": %.0f,\n"
+	       "    \"min\": %llu,\n"
+	       "    \"avg\": %.0f,\n"
+	       "    \"max\": %llu,\n"
+	       "    \"mdev\": %.0f,\n"
+	       "    \"p50\": %llu,\n"
+	       "    \"p90\": %llu,\n"
+	       "    \"p99\": %llu,\n"
+	       "    \"p999\": %llu,\n"
+	       "    \"p9999\": %llu\n"
+	       "  },\n",
+	       name,
+	       s->valid,
+	       s->size,
+	       s->sum,
+	       s->iops,
+	       s->speed,
+	       s->min,
+	       s->avg,
+	       s->max,
+	       s->mdev,
+	       s->percentile[0],
+	       s->percentile[1],
+	       s->percentile[2],
+	       s->percentile[3],
+	       s->percentile[4]);
+}
+
+static void json_size_split(int i, struct statistics *s)
+{
+	printf("    {\"size\": %zd, \"weight\": %d, \"count\": %llu, "
+	       "\"iops\": %f, \"bps\": %.0f, "
+	       "\"min\": %llu, \"avg\": %.0f, \"max\": %llu, \"mdev\": %.0f, "
+	       "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+	       "\"p999\": %llu, \"p9999\": %llu}%s\n",
+	       size_split[i].size,
+	       size_split[i].weight,
+	       s->valid,
+	       s->iops,
+	       s->speed,
+	       s->min,
+	       s->avg,
+	       s->max,
+	       s->mdev,
+	       s->percentile[0],
+	       s->percentile[1],
+	       s->percentile[2],
+	       s->percentile[3],
+	       s->percentile[4],
+	       i + 1 < nr_size_split ? "," : "");
+}
+
+static void json_statistics(struct target *t, struct statset *ss)
+{
+	struct statistics *s = &ss->all, *co = &ss->co;
+	int i;
+
+	update_timestamp();
+
+	printf("%s{\n"
+	       "  \"timestamp\": %s,\n"
+	       "  \"localtime\": \"%s\",\n"
+	       "  \"target\": {\n"
+	       "    \"path\": \"%s\",\n"
+	       "    \"fstype\": \"%s\",\n"
+	       "    \"device\": \"%s\",\n"
+	       "    \"device_size\": %lld\n"
+	       "  },\n"
+	       "  \"engine\": {\n"
+	       "    \"name\": \"%s\",\n"
+	       "    \"mode\": \"%s\",\n"
+	       "    \"iodepth\": %d,\n"
+	       "    \"threads\": %d\n"
 	       "  },\n"
-	       "  \"load\": {\n"
+	       "  \"clock\": {\n"
+	       "    \"source\": \"%s\",\n"
+	       "    \"overhead\": %lld,\n"
+	       "    \"resolution\": %lld\n"
+	       "  },\n"
+	       "  \"stat\": {\n"
 	       "    \"count\": %llu,\n"
-	       "    \"failed\": %llu,\n"
 	       "    \"size\": %llu,\n"
-	       "    \"time\": %llu,\n"
+	       "    \"time\": %.0f,\n"
 	       "    \"iops\": %f,\n"
-	       "    \"bps\": %.0f\n"
-	       "  }\n"
-	       "}",
+	       "    \"bps\": %.0f,\n"
+	       "    \"min\": %llu,\n"
+	       "    \"avg\": %.0f,\n"
+	       "    \"max\": %llu,\n"
+	       "    \"mdev\": %.0f,\n"
+	       "    \"p50\": %llu,\n"
+	       "    \"p90\": %llu,\n"
+	       "    \"p99\": %llu,\n"
+	       "    \"p999\": %llu,\n"
+	       "    \"p9999\": %llu\n"
+	       "  },\n",
 	       json_line++ ? "," : "",
 	       timestamp_str,
 	       localtime_str,
-	       path,
-	       fstype,
-	       device,
-	       device_size,
+	       t->path,
+	       t->fstype,
+	       t->device,
+	       t->device_size,
+	       engine,
+	       engine_mode,
+	       iodepth,
+	       nr_threads,
+	       clock_source,
+	       clock_overhead,
+	       clock_resolution,
 	       s->valid,
 	       s->size,
 	       s->sum,
@@ -1738,33 +3732,2282 @@ static void json_statistics(struct statistics *s)
 	       s->avg,
 	       s->max,
 	       s->mdev,
+	       s->percentile[0],
+	       s->percentile[1],
+	       s->percentile[2],
+	       s->percentile[3],
+	       s->percentile[4]);
+
+	if (co_correct)
+		printf("  \"corrected\": {\n"
+		       "    \"count\": %llu,\n"
+		       "    \"backfilled\": %llu,\n"
+		       "    \"min\": %llu,\n"
+		       "    \"avg\": %.0f,\n"
+		       "    \"max\": %llu,\n"
+		       "    \"mdev\": %.0f,\n"
+		       "    \"p50\": %llu,\n"
+		       "    \"p90\": %llu,\n"
+		       "    \"p99\": %llu,\n"
+		       "    \"p999\": %llu,\n"
+		       "    \"p9999\": %llu\n"
+		       "  },\n",
+		       co->valid,
+		       co->valid - s->valid,
+		       co->min,
+		       co->avg,
+		       co->max,
+		       co->mdev,
+		       co->percentile[0],
+		       co->percentile[1],
+		       co->percentile[2],
+		       co->percentile[3],
+		       co->percentile[4]);
+
+	if (mixed_rw()) {
+		json_operation("read", &ss->op[0]);
+		json_operation("write", &ss->op[1]);
+	}
+
+	if (nr_size_split) {
+		printf("  \"sizes\": [\n");
+		for (i = 0; i < nr_size_split; i++)
+			json_size_split(i, &ss->split[i]);
+		printf("  ],\n");
+	}
+
+	if (split_sync()) {
+		json_operation("data", &ss->data);
+		json_operation("sync", &ss->sync);
+	}
+
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			json_operation(meta_names[i], &ss->meta[i]);
+
+	if (t->prep_size && t->prep_time)
+		printf("  \"preparation\": {\n"
+		       "    \"size\": %lld,\n"
+		       "    \"time\": %lld,\n"
+		       "    \"bps\": %.0f,\n"
+		       "    \"writers\": %d\n"
+		       "  },\n",
+		       t->prep_size,
+		       t->prep_time,
+		       (double)t->prep_size * NSEC_PER_SEC / t->prep_time,
+		       t->prep_writers);
+
+	printf("  \"schedule\": {\n"
+	       "    \"count\": %llu,\n"
+	       "    \"min\": %llu,\n"
+	       "    \"avg\": %.0f,\n"
+	       "    \"max\": %llu\n"
+	       "  },\n",
+	       s->sched_count,
+	       s->sched_min,
+	       s->sched_avg,
+	       s->sched_max);
+
+	printf("  \"load\": {\n"
+	       "    \"count\": %llu,\n"
+	       "    \"failed\": %llu,\n"
+	       "    \"corrupted\": %llu,\n"
+	       "    \"size\": %llu,\n"
+	       "    \"time\": %llu,\n"
+	       "    \"iops\": %f,\n"
+	       "    \"bps\": %.0f\n"
+	       "  }\n"
+	       "}",
 	       s->count,
 	       s->failed,
+	       s->corrupted,
 	       s->load_size,
 	       s->load_time,
 	       s->load_iops,
 	       s->load_speed);
 }
 
-int main (int argc, char **argv)
+/*
+ * Binary trace: header and fixed-size records in host byte order, written
+ * through shared mappings of chunks. File is extended by ftruncate and next
+ * chunk is mapped ahead of writers, mapped chunks never move.
+ */
+#define TRACE_MAGIC	"IOPINGTR"
+#define TRACE_VERSION	1
+#define TRACE_CHUNK	(1 << 16)	/* records */
+#define TRACE_MAX_CHUNKS	(1 << 16)
+
+struct trace_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	record_size;
+	uint64_t	start;		/* ns, same clock as records */
+	uint64_t	size;		/* request size */
+	uint32_t	iodepth;
+	uint32_t	threads;
+	int64_t		clock_overhead;
+	int64_t		clock_resolution;
+	char		engine[16];
+	char		clock[16];
+	char		reserved[40];
+};
+
+struct trace_record {
+	uint64_t	request;
+	uint64_t	offset;
+	uint64_t	start;		/* ns, submission */
+	uint64_t	finish;		/* ns, completion */
+	int64_t		result;		/* bytes or -errno */
+	uint32_t	size;
+	uint16_t	target;
+	uint8_t		write;
+	uint8_t		engine;		/* index in trace_engines */
+};
+
+static const char *trace_engines[] = { "pread", "preadv2", "aio", "uring", "mmap" };
+
+#define NR_TRACE_ENGINES (sizeof(trace_engines) / sizeof(trace_engines[0]))
+
+#ifdef HAVE_MMAP
+
+int trace_fd = -1;
+struct trace_header *trace_map;
+struct trace_record *trace_chunks[TRACE_MAX_CHUNKS];
+atomic_llong trace_count;
+atomic_llong trace_capacity;
+int trace_engine;
+
+#ifdef HAVE_PTHREAD
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static off_t trace_chunk_offset(long long chunk)
+{
+	return sizeof(struct trace_header) +
+		(off_t)chunk * TRACE_CHUNK * sizeof(struct trace_record);
+}
+
+/* mapping starts at page boundary, chunk 0 also covers header */
+static void trace_chunk_range(long long chunk, off_t *start, size_t *length)
+{
+	off_t offset = trace_chunk_offset(chunk);
+
+	*start = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	*length = trace_chunk_offset(chunk + 1) - *start;
+}
+
+static void trace_extend(long long slot)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&trace_lock);
+#endif
+	while (slot >= trace_capacity) {
+		long long chunk = trace_capacity / TRACE_CHUNK;
+		size_t length;
+		off_t start;
+		char *map;
+
+		if (chunk >= TRACE_MAX_CHUNKS)
+			errx(3, "trace is too big");
+		if (ftruncate(trace_fd, trace_chunk_offset(chunk + 1)))
+			err(3, "failed to extend trace");
+		trace_chunk_range(chunk, &start, &length);
+		map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, trace_fd, start);
+		if (map == MAP_FAILED)
+			err(3, "failed to map trace");
+		if (!chunk)
+			trace_map = (struct trace_header *)map;
+		trace_chunks[chunk] = (struct trace_record *)
+			(map + trace_chunk_offset(chunk) - start);
+		/* publishes chunk for writers */
+		trace_capacity += TRACE_CHUNK;
+	}
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+static void trace_open(long long start)
+{
+	unsigned i;
+
+	trace_fd = open(trace_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (trace_fd < 0)
+		err(2, "failed to create trace \"%s\"", trace_path);
+
+	trace_extend(0);
+
+	memcpy(trace_map->magic, TRACE_MAGIC, sizeof(trace_map->magic));
+	trace_map->version = TRACE_VERSION;
+	trace_map->record_size = sizeof(struct trace_record);
+	trace_map->start = start;
+	trace_map->size = size;
+	trace_map->iodepth = iodepth;
+	trace_map->threads = nr_threads;
+	trace_map->clock_overhead = clock_overhead;
+	trace_map->clock_resolution = clock_resolution;
+	strncpy(trace_map->engine, engine, sizeof(trace_map->engine) - 1);
+	strncpy(trace_map->clock, clock_source, sizeof(trace_map->clock) - 1);
+
+	for (i = 0; i < NR_TRACE_ENGINES; i++)
+		if (!strcmp(engine, trace_engines[i]))
+			trace_engine = i;
+}
+
+static void trace_request(struct inflight *io, long long this_time)
+{
+	long long slot = atomic_fetch_add(&trace_count, 1);
+	struct trace_record *rec;
+
+	if (slot >= trace_capacity)
+		trace_extend(slot);
+
+	rec = trace_chunks[slot / TRACE_CHUNK] + slot % TRACE_CHUNK;
+	rec->request = io->request;
+	rec->offset = io->offset;
+	rec->start = io->start;
+	rec->finish = io->start + this_time;
+	rec->result = io->result < 0 ? -io->error : io->result;
+	rec->size = io->size;
+	rec->target = target - targets;
+	rec->write = io->write;
+	rec->engine = trace_engine;
+}
+
+static void trace_close(void)
+{
+	long long chunk;
+	size_t length;
+	off_t start;
+
+	for (chunk = 0; chunk < trace_capacity / TRACE_CHUNK; chunk++) {
+		trace_chunk_range(chunk, &start, &length);
+		munmap((char *)trace_chunks[chunk] -
+		       (trace_chunk_offset(chunk) - start), length);
+	}
+	if (ftruncate(trace_fd, sizeof(struct trace_header) +
+				trace_count * sizeof(struct trace_record)))
+		err(3, "failed to truncate trace");
+	if (close(trace_fd))
+		err(3, "failed to close trace");
+}
+
+#else /* HAVE_MMAP */
+
+static void trace_open(long long start)
+{
+	(void)start;
+	errx(1, "trace is not supported by this platform");
+}
+
+static void trace_request(struct inflight *io, long long this_time)
+{
+	(void)io;
+	(void)this_time;
+}
+
+static void trace_close(void)
+{
+}
+
+#endif /* HAVE_MMAP */
+
+struct replay_entry {
+	long long	time;		/* ns since start */
+	off_t		offset;
+	size_t		size;
+	int		write;
+};
+
+struct replay_entry *replay;
+long long nr_replay;
+long long replay_start;
+_Thread_local long long replay_next;
+
+static void replay_add(long long time, off_t offset, size_t length, int write)
+{
+	static long long nr_alloc;
+
+	if (nr_replay == nr_alloc) {
+		nr_alloc = nr_alloc ? nr_alloc * 2 : 1024;
+		replay = realloc(replay, sizeof(*replay) * nr_alloc);
+		if (!replay)
+			err(2, NULL);
+	}
+
+	replay[nr_replay].time = time;
+	replay[nr_replay].offset = offset;
+	replay[nr_replay].size = length;
+	replay[nr_replay].write = write;
+	nr_replay++;
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+	const struct replay_entry *x = a, *y = b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/* binary trace written by -trace, records are in order of completion */
+static void replay_load_trace(FILE *file)
+{
+	struct trace_header hdr;
+	struct trace_record rec;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    hdr.version != TRACE_VERSION || hdr.record_size != sizeof(rec))
+		errx(2, "unsupported trace version in \"%s\"", replay_path);
+
+	while (fread(&rec, sizeof(rec), 1, file) == 1)
+		if (rec.request)
+			replay_add(rec.start - hdr.start, rec.offset,
+				   rec.size, rec.write);
+}
+
+/* text: "<time> <operation> <offset> <length>" per line */
+static void replay_load_text(FILE *file)
+{
+	char *line = NULL, time[64], op[16], off[64], len[64];
+	size_t line_size = 0;
+	long long nr_line = 0;
+
+	while (getline(&line, &line_size, file) >= 0) {
+		char *ptr = line + strspn(line, " \t");
+		int write;
+
+		nr_line++;
+		if (*ptr == '#' || *ptr == '\n' || !*ptr)
+			continue;
+
+		if (sscanf(ptr, "%63s %15s %63s %63s", time, op, off, len) != 4)
+			errx(2, "invalid replay record at %s:%lld",
+			     replay_path, nr_line);
+
+		if (op[0] == 'R' || op[0] == 'r')
+			write = 0;
+		else if (op[0] == 'W' || op[0] == 'w')
+			write = 1;
+		else
+			errx(2, "invalid operation \"%s\" at %s:%lld",
+			     op, replay_path, nr_line);
+
+		replay_add(parse_time(time), parse_offset(off),
+			   parse_size(len), write);
+	}
+
+	free(line);
+}
+
+static void replay_load(void)
+{
+	char magic[sizeof(TRACE_MAGIC) - 1];
+	long long i, first;
+	FILE *file;
+
+	file = fopen(replay_path, "r");
+	if (!file)
+		err(2, "failed to open replay \"%s\"", replay_path);
+
+	if (fread(magic, sizeof(magic), 1, file) == 1 &&
+	    !memcmp(magic, TRACE_MAGIC, sizeof(magic))) {
+		rewind(file);
+		replay_load_trace(file);
+	} else {
+		rewind(file);
+		replay_load_text(file);
+	}
+
+	if (ferror(file))
+		err(2, "failed to read replay \"%s\"", replay_path);
+	fclose(file);
+
+	if (!nr_replay)
+		errx(2, "no requests in replay \"%s\"", replay_path);
+
+	qsort(replay, nr_replay, sizeof(*replay), replay_cmp);
+
+	/* buffers are allocated for the largest request */
+	size = 0;
+	first = replay[0].time;
+	for (i = 0; i < nr_replay; i++) {
+		replay[i].time -= first;
+		if (replay[i].size <= 0)
+			errx(2, "zero length request in replay \"%s\"", replay_path);
+		if ((ssize_t)replay[i].size > size)
+			size = replay[i].size;
+		if (replay[i].write && !write_test)
+			errx(1, "replay contains writes, please read manpage "
+				"about option -write");
+	}
+}
+
+static void replay_check(struct target *t)
+{
+	long long i;
+
+	for (i = 0; i < nr_replay; i++)
+		if (replay[i].offset + (off_t)replay[i].size > t->wsize)
+			errx(2, "replay does not fit into working set of \"%s\", "
+				"use option -work-size", t->path);
+}
+
+_Thread_local long long time_now, time_next;
+long long period_deadline;
+
+#ifdef HAVE_PTHREAD
+
+struct worker {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	struct target		*target;
+	struct statset		stat;	/* drained by reporter, under lock */
+	unsigned long long	random_state[2];
+	void			*buf;
+	int			fd;
+	int			cpu;
+};
+
+struct worker *workers;
+
+pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workers_cond;
+int nr_running;
+
+#endif /* HAVE_PTHREAD */
+
+/* worker of current thread, NULL in single-threaded mode */
+static _Thread_local struct worker *self;
+
+#ifndef __MINGW32__
+
+/* slot of worker among workers of its target */
+static int meta_worker(void)
+{
+#ifdef HAVE_PTHREAD
+	if (self)
+		return (self - workers) % nr_threads;
+#endif
+	return 0;
+}
+
+_Thread_local int meta_renamed;
+static bool meta_exit_registered;
+
+static void meta_cleanup(struct target *t);
+
+/* remove pools also when exiting with error */
+static void meta_exit(void)
+{
+	int i;
+
+	for (i = 0; i < nr_targets; i++)
+		if (targets[i].meta_path)
+			meta_cleanup(&targets[i]);
+}
+
+/*
+ * Pool directory keeps files "0".."N-1" for stat and open, each worker
+ * creates and removes own "c<worker>", "d<worker>" and renames "r<worker>"
+ * into "s<worker>" and back.
+ */
+static int meta_setup(struct target *t)
+{
+	int length = strlen(t->path) + 20;
+	char *path = malloc(length);
+	char name[32];
+	int dir, fd, i;
+
+	if (!path)
+		err(2, NULL);
+	snprintf(path, length, "%s/ioping.meta", t->path);
+
+	if (keep_file) {
+		if (mkdir(path, 0700) && errno != EEXIST)
+			err(2, "failed to create \"%s\"", path);
+	} else {
+		strcat(path, ".XXXXXX");
+		if (!mkdtemp(path))
+			err(2, "failed to create directory at \"%s\"", t->path);
+	}
+
+	dir = open(path, O_RDONLY | O_DIRECTORY);
+	if (dir < 0) {
+		if (!keep_file)
+			(void)rmdir(path);
+		err(2, "failed to open \"%s\"", path);
+	}
+
+	t->fd = dir;
+	t->meta_path = path;
+	if (!meta_exit_registered) {
+		atexit(meta_exit);
+		meta_exit_registered = true;
+	}
+
+	for (i = 0; i < meta_files; i++) {
+		snprintf(name, sizeof(name), "%d", i);
+		fd = openat(dir, name, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			err(2, "failed to create \"%s/%s\"", t->meta_path, name);
+		close(fd);
+	}
+
+	/* cleanup after interrupted run with -keep */
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(name, sizeof(name), "c%d", i);
+		(void)unlinkat(dir, name, 0);
+		snprintf(name, sizeof(name), "d%d", i);
+		(void)unlinkat(dir, name, AT_REMOVEDIR);
+		snprintf(name, sizeof(name), "s%d", i);
+		(void)unlinkat(dir, name, 0);
+		snprintf(name, sizeof(name), "r%d", i);
+		fd = openat(dir, name, O_RDWR | O_CREAT, 0600);
+		if (fd < 0)
+			err(2, "failed to create \"%s/%s\"", t->meta_path, name);
+		close(fd);
+	}
+
+	if (fsync(dir))
+		err(2, "fsync failed");
+
+	return dir;
+}
+
+static ssize_t meta_request(struct inflight *io)
+{
+	char name[32], other[32];
+	int worker = meta_worker();
+	struct stat st;
+	int fd;
+
+	switch (io->meta) {
+	case META_CREATE:
+		snprintf(name, sizeof(name), "c%d", worker);
+		fd = openat(target_fd, name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+			return -1;
+		return close(fd);
+	case META_UNLINK:
+		snprintf(name, sizeof(name), "c%d", worker);
+		return unlinkat(target_fd, name, 0);
+	case META_STAT:
+		snprintf(name, sizeof(name), "%lld", (long long)io->offset);
+		return fstatat(target_fd, name, &st, 0);
+	case META_OPEN:
+		snprintf(name, sizeof(name), "%lld", (long long)io->offset);
+		fd = openat(target_fd, name, O_RDONLY);
+		if (fd < 0)
+			return -1;
+		return close(fd);
+	case META_RENAME:
+		snprintf(name, sizeof(name), "%c%d", meta_renamed ? 's' : 'r', worker);
+		snprintf(other, sizeof(other), "%c%d", meta_renamed ? 'r' : 's', worker);
+		if (renameat(target_fd, name, target_fd, other))
+			return -1;
+		meta_renamed = !meta_renamed;
+		return 0;
+	case META_MKDIR:
+		snprintf(name, sizeof(name), "d%d", worker);
+		return mkdirat(target_fd, name, 0700);
+	case META_RMDIR:
+		snprintf(name, sizeof(name), "d%d", worker);
+		return unlinkat(target_fd, name, AT_REMOVEDIR);
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+static void meta_cleanup(struct target *t)
+{
+	char name[32];
+	int i;
+
+	if (keep_file || !t->meta_path)
+		return;
+
+	for (i = 0; i < meta_files; i++) {
+		snprintf(name, sizeof(name), "%d", i);
+		(void)unlinkat(t->fd, name, 0);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		snprintf(name, sizeof(name), "c%d", i);
+		(void)unlinkat(t->fd, name, 0);
+		snprintf(name, sizeof(name), "d%d", i);
+		(void)unlinkat(t->fd, name, AT_REMOVEDIR);
+		snprintf(name, sizeof(name), "r%d", i);
+		(void)unlinkat(t->fd, name, 0);
+		snprintf(name, sizeof(name), "s%d", i);
+		(void)unlinkat(t->fd, name, 0);
+	}
+
+	if (rmdir(t->meta_path))
+		warn("failed to remove \"%s\"", t->meta_path);
+	free(t->meta_path);
+	t->meta_path = NULL;
+}
+
+#else /* __MINGW32__ */
+
+static int meta_setup(struct target *t)
+{
+	(void)t;
+	errx(1, "metadata mode is not supported by this platform");
+}
+
+static ssize_t meta_request(struct inflight *io)
+{
+	(void)io;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void meta_cleanup(struct target *t)
+{
+	(void)t;
+}
+
+#endif /* __MINGW32__ */
+
+static void bind_cpu(int cpu)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		err(2, "failed to bind to cpu %d", cpu);
+#else
+	(void)cpu;
+	errx(1, "binding to cpu is not supported by this platform");
+#endif
+}
+
+static void start_engine(void)
+{
+	if (async_uring) {
+		uring_init();
+		if (uring_fixed)
+			uring_register();
+	} else if (async) {
+		aio_init();
+	}
+}
+
+/* reserve next request in -count limit shared between threads of target */
+static bool claim_request(void)
+{
+	if (replay && replay_next >= nr_replay)
+		return false;
+
+	return !stop_at_request ||
+		atomic_fetch_add(&target->claimed_request, 1) < stop_at_request;
+}
+
+static void prepare_request(struct inflight *io)
+{
+	io->request = ++request;
+	io->intended = time_next;
+	io->sync_time = 0;
+	io->corrupted = false;
+
+	/* offset is index of file in pool */
+	if (nr_meta_ops) {
+		io->meta = meta_ops[(io->request - 1) % nr_meta_ops];
+		io->offset = randomize ? (long long)(random64() % meta_files) :
+					 (io->request - 1) % meta_files;
+		io->size = 0;
+		io->write = io->meta != META_STAT && io->meta != META_OPEN;
+		return;
+	}
+
+	if (replay) {
+		struct replay_entry *entry = &replay[replay_next];
+
+		/* workers of target share replay in round robin */
+		replay_next += nr_threads;
+		io->offset = offset + entry->offset;
+		io->size = entry->size;
+		io->write = entry->write;
+		goto prepare;
+	}
+
+	io->size = size;
+	if (nr_size_split) {
+		int weight = random64() % size_split_weight;
+
+		for (io->split = 0; weight >= size_split[io->split].weight;
+		     io->split++)
+			weight -= size_split[io->split].weight;
+		io->size = size_split[io->split].size;
+	}
+
+	if (randomize) {
+		woffset = random_block(target) * min_size;
+		/* align to request size and keep it inside */
+		woffset -= woffset % io->size;
+		if (woffset + (off_t)io->size > target->wsize)
+			woffset -= io->size;
+	}
+
+	io->offset = offset + woffset;
+
+	if (!randomize) {
+		woffset += io->size;
+		if (woffset + size > target->wsize)
+			woffset = 0;
+	}
+
+	if (rw_mix >= 0)
+		io->write = random64() % 100 < (unsigned)rw_mix;
+	else
+		io->write = write_read_test ? request & 1 : write_test;
+
+prepare:
+#ifdef HAVE_MMAP
+	/* page cache cannot drop pages mapped into memory */
+	if (use_mmap && !cached) {
+		off_t start = io->offset & ~(page_size - 1);
+
+		if (madvise(target->map + start, io->offset + io->size - start,
+			    MADV_DONTNEED))
+			err(3, "madvise(DONTNEED) failed");
+	}
+#endif
+
+#ifdef HAVE_POSIX_FADVICE
+	if (!cached && posix_fadvise(target_fd, io->offset, io->size,
+				     POSIX_FADV_DONTNEED))
+		err(3, "fadvise(DONTNEED) failed, "
+		       "please retry with option -C");
+#endif
+
+	if (io->write)
+		write_memory(io->buf, io->size);
+
+	if (io->write && verify)
+		verify_stamp(io->buf, io->offset, io->size,
+			     atomic_fetch_add(&verify_sequence, 1) + 1);
+}
+
+static long long arrival_delay(void)
+{
+	long long next;
+
+	switch (arrival) {
+	case ARRIVAL_JITTER:
+		return interval - arrival_jitter +
+			random64() % (2 * arrival_jitter + 1);
+	case ARRIVAL_POISSON:
+		return random_exp(interval);
+	case ARRIVAL_ONOFF:
+		next = time_next + random_exp(interval);
+		/* process is memoryless: restart arrivals after off period */
+		while (next > arrival_switch) {
+			next = arrival_switch + random_exp(arrival_off);
+			arrival_switch = next + random_exp(arrival_on);
+			next += random_exp(interval);
+		}
+		return next - time_next;
+	default:
+		return interval;
+	}
+}
+
+static void schedule_request(void)
+{
+	/* recorded timing, open-loop */
+	if (replay && interval) {
+		if (replay_next < nr_replay)
+			time_next = replay_start + replay[replay_next].time;
+		return;
+	}
+
+	if (!burst || ++burst_request == burst) {
+	    burst_request = 0;
+	    time_next += arrival_delay();
+	}
+
+	/* fixed schedule skips missed requests, open-loop keeps backlog */
+	if (arrival == ARRIVAL_FIXED && (time_now - time_next) > 0)
+		time_next = time_now;
+}
+
+static void wait_request(void)
+{
+	long long wakeup = time_next - spin_time;
+
+	if ((time_next - time_now) <= 0)
+		return;
+
+	if (!quiet)
+	    fflush(stdout);
+
+	if ((wakeup - time_now) > 0) {
+		struct timespec interval_ts;
+#ifdef HAVE_CLOCK_NANOSLEEP
+		/* absolute deadline does not accumulate wakeup latency */
+		wakeup = system_deadline(wakeup);
+		interval_ts.tv_sec = wakeup / NSEC_PER_SEC;
+		interval_ts.tv_nsec = wakeup % NSEC_PER_SEC;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &interval_ts, NULL) == EINTR && !exiting)
+			;
+#else
+		long long delta = wakeup - time_now;
+
+		interval_ts.tv_sec = delta / NSEC_PER_SEC;
+		interval_ts.tv_nsec = delta % NSEC_PER_SEC;
+
+		nanosleep(&interval_ts, NULL);
+#endif
+	}
+
+	while (spin_time && !exiting && (time_next - now()) > 0)
+		;
+}
+
+/*
+ * Metrics in Prometheus text format, cumulative since start.
+ * Buckets are bounds of latency histogram, precision is about 1%.
+ */
+static const double metrics_buckets[] = {
+	1e-6, 2e-6, 5e-6, 1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4,
+	1e-3, 2e-3, 5e-3, 1e-2, 2e-2, 5e-2, 0.1, 0.2, 0.5, 1, 2, 5, 10,
+};
+
+#define NR_METRICS_BUCKETS (sizeof(metrics_buckets) / sizeof(metrics_buckets[0]))
+
+static const struct {
+	const char	*name;
+	const char	*help;
+	size_t		offset;
+} metrics_counters[] = {
+	{ "ioping_requests_total", "Requests issued.",
+	  offsetof(struct statistics, count) },
+	{ "ioping_requests_failed_total", "Requests failed.",
+	  offsetof(struct statistics, failed) },
+	{ "ioping_requests_too_slow_total", "Requests slower than max-time.",
+	  offsetof(struct statistics, too_slow) },
+	{ "ioping_requests_too_fast_total", "Requests faster than min-time.",
+	  offsetof(struct statistics, too_fast) },
+	{ "ioping_requests_corrupted_total", "Requests with corrupted data.",
+	  offsetof(struct statistics, corrupted) },
+	{ "ioping_issued_bytes_total", "Bytes in issued requests.",
+	  offsetof(struct statistics, load_size) },
+	{ "ioping_transferred_bytes_total", "Bytes in valid requests.",
+	  offsetof(struct statistics, size) },
+};
+
+#define NR_METRICS_COUNTERS (sizeof(metrics_counters) / sizeof(metrics_counters[0]))
+
+static void metrics_value(FILE *f, const char *value)
+{
+	for (; *value; value++) {
+		if (*value == '\\' || *value == '"')
+			fputc('\\', f);
+		if (*value == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*value, f);
+	}
+}
+
+static void metrics_labels(FILE *f, struct target *t)
+{
+	fputs("target=\"", f);
+	metrics_value(f, t->path);
+	fputs("\",fstype=\"", f);
+	metrics_value(f, t->fstype);
+	fputs("\",device=\"", f);
+	metrics_value(f, t->device);
+	fputc('"', f);
+}
+
+static void metrics_render(FILE *f)
+{
+	const char *name = "ioping_request_duration_seconds";
+	unsigned i, b;
+	int j, h;
+
+	for (i = 0; i < NR_METRICS_COUNTERS; i++) {
+		fprintf(f, "# HELP %s %s\n# TYPE %s counter\n",
+			metrics_counters[i].name, metrics_counters[i].help,
+			metrics_counters[i].name);
+		for (j = 0; j < nr_targets; j++) {
+			struct statistics *s = &targets[j].total.all;
+
+			fprintf(f, "%s{", metrics_counters[i].name);
+			metrics_labels(f, &targets[j]);
+			fprintf(f, "} %lld\n", *(long long *)
+				((char *)s + metrics_counters[i].offset));
+		}
+	}
+
+	fprintf(f, "# HELP %s Time of valid requests.\n"
+		   "# TYPE %s histogram\n", name, name);
+	for (j = 0; j < nr_targets; j++) {
+		struct statistics *s = &targets[j].total.all;
+		long long count = 0;
+
+		for (b = 0, h = 0; b < NR_METRICS_BUCKETS; b++) {
+			int last = hist_index(metrics_buckets[b] * NSEC_PER_SEC);
+
+			while (h <= last)
+				count += s->hist[h++];
+			fprintf(f, "%s_bucket{", name);
+			metrics_labels(f, &targets[j]);
+			fprintf(f, ",le=\"%g\"} %lld\n", metrics_buckets[b], count);
+		}
+		fprintf(f, "%s_bucket{", name);
+		metrics_labels(f, &targets[j]);
+		fprintf(f, ",le=\"+Inf\"} %lld\n", s->valid);
+		fprintf(f, "%s_sum{", name);
+		metrics_labels(f, &targets[j]);
+		fprintf(f, "} %.9f\n", s->sum / NSEC_PER_SEC);
+		fprintf(f, "%s_count{", name);
+		metrics_labels(f, &targets[j]);
+		fprintf(f, "} %lld\n", s->valid);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+
+/* latest rendered metrics served by http thread */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *metrics_text;
+static size_t metrics_length;
+static int metrics_fd = -1;
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	for (; len; buf += ret, len -= ret) {
+		ret = write(fd, buf, len);
+		if (ret <= 0)
+			break;
+	}
+}
+
+/* answer any request with metrics */
+static void *metrics_server(void *arg)
+{
+	struct timespec backoff = { .tv_sec = 1 };
+	struct timeval timeout = { .tv_sec = 1 };
+	bool failing = false;
+	char request[1024], header[256];
+	size_t length;
+	char *text;
+	ssize_t ret;
+	int fd;
+
+	(void)arg;
+
+	for (;;) {
+		fd = accept(metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* persistent errors like EMFILE: do not spin */
+			if (!failing)
+				warn("metrics server accept failed");
+			failing = true;
+			nanosleep(&backoff, NULL);
+			continue;
+		}
+		failing = false;
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		ret = read(fd, request, sizeof(request));
+		(void)ret;
+
+		pthread_mutex_lock(&metrics_lock);
+		length = metrics_length;
+		text = malloc(length + 1);
+		if (text)
+			memcpy(text, metrics_text, length);
+		pthread_mutex_unlock(&metrics_lock);
+
+		if (text) {
+			snprintf(header, sizeof(header),
+				 "HTTP/1.0 200 OK\r\n"
+				 "Content-Type: text/plain; version=0.0.4\r\n"
+				 "Content-Length: %zu\r\n"
+				 "Connection: close\r\n\r\n", length);
+			write_all(fd, header, strlen(header));
+			write_all(fd, text, length);
+			free(text);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+static void metrics_listen(const char *addr)
+{
+	char *host = strdup(addr), *port = strrchr(host, ':'), *end;
+	struct addrinfo hints, *ai;
+	pthread_t thread;
+	int one = 1, ret;
+
+	if (port) {
+		*port++ = 0;
+		/* [::1]:9100 */
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = 0;
+			memmove(host, host + 1, strlen(host));
+		}
+	} else {
+		port = host;
+	}
+
+	ret = strtol(port, &end, 10);
+	if (*end || end == port || ret <= 0 || ret > 65535)
+		errx(1, "invalid metrics port \"%s\"", addr);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	/* endpoint has no authentication: other interfaces only on demand */
+	ret = getaddrinfo(port != host && host[0] ? host : "127.0.0.1",
+			  port, &hints, &ai);
+	if (ret)
+		errx(1, "invalid metrics address \"%s\": %s",
+		     addr, gai_strerror(ret));
+
+	metrics_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	if (metrics_fd < 0)
+		err(2, "socket failed");
+	setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(metrics_fd, ai->ai_addr, ai->ai_addrlen) ||
+	    listen(metrics_fd, 16))
+		err(2, "failed to listen at \"%s\"", addr);
+	freeaddrinfo(ai);
+	free(host);
+
+	/* client might disconnect in the middle */
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = pthread_create(&thread, NULL, metrics_server, NULL);
+	if (ret) {
+		errno = ret;
+		err(2, "failed to start thread");
+	}
+	pthread_detach(thread);
+}
+
+#else /* HAVE_PTHREAD */
+
+static void metrics_listen(const char *addr)
+{
+	(void)addr;
+	errx(1, "metrics server is not supported by this platform");
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* textfile is replaced atomically */
+static void metrics_update(void)
+{
+	if (metrics_file) {
+		int length = strlen(metrics_file) + 5;
+		char *temp = malloc(length);
+		FILE *f;
+
+		if (!temp)
+			err(2, NULL);
+		snprintf(temp, length, "%s.tmp", metrics_file);
+		f = fopen(temp, "w");
+		if (f) {
+			metrics_render(f);
+			if (fclose(f) || rename(temp, metrics_file))
+				warn("failed to write \"%s\"", metrics_file);
+		} else
+			warn("failed to create \"%s\"", temp);
+		free(temp);
+	}
+
+#ifdef HAVE_PTHREAD
+	if (metrics_fd >= 0) {
+		size_t length;
+		char *text;
+		FILE *f;
+
+		f = open_memstream(&text, &length);
+		if (!f)
+			err(2, NULL);
+		metrics_render(f);
+		if (fclose(f))
+			err(2, NULL);
+
+		pthread_mutex_lock(&metrics_lock);
+		free(metrics_text);
+		metrics_text = text;
+		metrics_length = length;
+		pthread_mutex_unlock(&metrics_lock);
+	}
+#endif
+}
+
+/* all targets are reported in the same time window */
+static void report_period(void)
+{
+	int i;
+
+	for (i = 0; i < nr_targets; i++) {
+		struct target *t = &targets[i];
+
+		finish_statset(&t->part, time_now);
+		if (metrics_only)
+			;
+		else if (json)
+			json_statistics(t, &t->part);
+		else
+			dump_statistics(&t->part);
+		merge_statset(&t->total, &t->part);
+		start_statset(&t->part, time_now);
+	}
+	if (metrics_addr || metrics_file)
+		metrics_update();
+	fflush(stdout);
+	period_deadline = time_now + period_time;
+}
+
+static int account_request(struct inflight *io, ssize_t ret_size,
+			   long long this_time)
+{
+	struct statset *s = &target->part;
+	int valid;
+
+	/* metadata operations transfer nothing, count success */
+	if (nr_meta_ops && io->result >= 0)
+		ret_size = 1;
+
+#ifdef HAVE_PTHREAD
+	if (self) {
+		s = &self->stat;
+		pthread_mutex_lock(&self->lock);
+	}
+#endif
+	/* notice is set by the last one */
+	add_statistics(&s->op[io->write], io->request, io->size,
+		       ret_size, this_time);
+	if (nr_size_split)
+		add_statistics(&s->split[io->split], io->request, io->size,
+			       ret_size, this_time);
+	if (io->write && split_sync())
+		add_statistics(&s->data, io->request, io->size,
+			       ret_size, this_time - io->sync_time);
+	if (nr_meta_ops)
+		add_statistics(&s->meta[io->meta], io->request, 0,
+			       ret_size, this_time);
+	valid = add_statistics(&s->all, io->request, io->size,
+			       ret_size, this_time);
+
+	/* corrupted data still counts in latency */
+	if (io->corrupted) {
+		s->all.corrupted++;
+		s->op[io->write].corrupted++;
+	}
+
+	if (valid)
+		add_schedule(&s->all, io->start - io->intended);
+
+	/* count also time spent behind schedule before submission */
+	if (valid && co_correct)
+		add_corrected(&s->co, this_time + io->start - io->intended);
+
+#ifdef HAVE_PTHREAD
+	if (self)
+		pthread_mutex_unlock(&self->lock);
+#endif
+	return valid;
+}
+
+/* one cache flush might complete several writes */
+static void account_sync(long long sync_time)
+{
+	struct statset *s = &target->part;
+
+#ifdef HAVE_PTHREAD
+	if (self) {
+		s = &self->stat;
+		pthread_mutex_lock(&self->lock);
+	}
+#endif
+	add_statistics(&s->sync, request, 0, 1, sync_time);
+#ifdef HAVE_PTHREAD
+	if (self)
+		pthread_mutex_unlock(&self->lock);
+#endif
+}
+
+#ifdef HAVE_MMAP
+
+/* touch one byte, write is followed by msync of its page */
+static void map_request(struct inflight *io)
+{
+	volatile char *ptr = target->map + io->offset;
+	off_t start = io->offset & ~(page_size - 1);
+
+	io->result = io->size;
+	io->error = 0;
+
+	if (!io->write) {
+		(void)*ptr;
+		return;
+	}
+
+	*ptr = random64();
+
+	if (cached)
+		return;
+
+	io->sync_time = now();
+	if (msync(target->map + start, io->offset + 1 - start, MS_SYNC)) {
+		io->result = -1;
+		io->error = errno;
+	}
+}
+
+#else /* HAVE_MMAP */
+
+static void map_request(struct inflight *io)
+{
+	io->result = -1;
+	io->error = ENOSYS;
+}
+
+#endif /* HAVE_MMAP */
+
+static void print_request(struct inflight *io, ssize_t ret_size,
+			  long long this_time, int valid)
+{
+	if (json) {
+		json_request(io, ret_size, this_time, valid);
+		return;
+	}
+
+	if (time_info) {
+		update_timestamp();
+		printf("%s ", localtime_str);
+	}
+	if (nr_meta_ops) {
+		printf("%s", meta_names[io->meta]);
+	} else {
+		print_size(ret_size);
+		printf(" %s", io->write ? ">>>" : "<<<");
+	}
+	printf(" %s (%s %s ", target->path, target->fstype, target->device);
+	print_size(target->device_size);
+	printf("): request=%llu time=", io->request);
+	print_time(this_time);
+	if (notice)
+	    printf(" (%s)", notice);
+	if (burst && !burst_request)
+	    printf("\n");
+	printf("\n");
+}
+
+static void complete_request(struct inflight *io, long long this_time)
+{
+	ssize_t ret_size = io->result;
+	int valid;
+
+	if (ret_size < 0) {
+		errno = io->error;
+		if (ignore_error || errno == EINTR || ((rw_flags & RWF_NOWAIT) && errno == EAGAIN)) {
+			ret_size = 0;
+			notice = errno_name();
+		} else
+			err(3, "request failed: %s", errno_name());
+	} else if (ret_size < (ssize_t)io->size)
+		warnx("request returned less than expected: %zu", ret_size);
+	else if (ret_size > (ssize_t)io->size)
+		errx(3, "request returned more than expected: %zu", ret_size);
+
+	if (verify && io->write)
+		verify_written(io, ret_size);
+	else if (verify && ret_size > 0)
+		io->corrupted = !verify_check(io->buf, io->offset, ret_size);
+
+	timestamp_uptodate = 0;
+
+	if (trace_path)
+		trace_request(io, this_time);
+
+	valid = account_request(io, ret_size, this_time);
+
+	if (io->corrupted)
+		notice = "corrupted";
+
+	if (!quiet) {
+#ifdef HAVE_PTHREAD
+		if (self)
+			flockfile(stdout);
+#endif
+		print_request(io, ret_size, this_time, valid);
+#ifdef HAVE_PTHREAD
+		if (self)
+			funlockfile(stdout);
+#endif
+	}
+
+	/* workers are reported by main thread */
+	if (!self && ((period_request && (target->part.all.valid >= period_request)) ||
+		      (period_time && (time_next >= period_deadline))))
+		report_period();
+}
+
+static bool stop_request(void)
+{
+	return exiting ||
+		(stop_at_request && target->claimed_request >= stop_at_request) ||
+		(replay && replay_next >= nr_replay) ||
+		(deadline && time_next >= deadline);
+}
+
+/* keep up to iodepth requests in flight */
+static void queue_requests(void)
+{
+	struct inflight *slots, **idle, **done;
+	int nr_idle, nr_inflight = 0;
+	bool stop = false;
+	int i;
+
+	slots = calloc(iodepth, sizeof(*slots));
+	idle = calloc(iodepth, sizeof(*idle));
+	done = calloc(iodepth, sizeof(*done));
+	if (!slots || !idle || !done)
+		err(2, NULL);
+
+	for (i = 0; i < iodepth; i++) {
+		slots[i].buf = (char *)buf + i * size;
+		idle[i] = &slots[i];
+	}
+	nr_idle = iodepth;
+
+	while (nr_inflight || !stop) {
+		int nr_submit = 0, nr_wait, nr_done;
+		long long reap_time, sync_time = 0, timeout;
+		bool sync = false;
+
+		while (!stop && nr_idle && (time_now - time_next) >= 0) {
+			struct inflight *io;
+
+			if (!claim_request()) {
+				stop = true;
+				break;
+			}
+
+			io = idle[--nr_idle];
+			prepare_request(io);
+			io->start = now();
+			queue_prep(io);
+			nr_submit++;
+			nr_inflight++;
+			schedule_request();
+			stop = stop_request();
+		}
+
+		if (!nr_inflight) {
+			if (!stop) {
+				wait_request();
+				time_now = now();
+			}
+			continue;
+		}
+
+		/* wait only if there is nothing to submit right now */
+		nr_wait = !nr_idle || stop || (time_next - time_now) > 0;
+
+		/* but do not hold back next arrival behind slow completion */
+		timeout = -1;
+		if (nr_idle && !stop) {
+			timeout = time_next - now();
+			if (timeout <= 0) {
+				timeout = 0;
+				nr_wait = 0;
+			}
+		}
+
+		nr_done = queue_run(nr_submit, nr_wait, done, iodepth, timeout);
+
+		time_now = reap_time = now();
+
+		for (i = 0; i < nr_done; i++)
+			if (done[i]->write && done[i]->result >= 0)
+				sync = true;
+
+		if (sync && !cached) {
+			sync_file(target_fd);
+			time_now = now();
+			sync_time = time_now - reap_time;
+			account_sync(sync_time);
+		}
+
+		/* reads do not wait for flush */
+		for (i = 0; i < nr_done; i++) {
+			struct inflight *io = done[i];
+
+			idle[nr_idle++] = io;
+			if (io->write) {
+				io->sync_time = sync_time;
+				complete_request(io, time_now - io->start);
+			} else
+				complete_request(io, reap_time - io->start);
+		}
+
+		nr_inflight -= nr_done;
+		stop = stop || stop_request();
+	}
+
+	free(slots);
+	free(idle);
+	free(done);
+}
+
+static void run_requests(void)
+{
+	struct inflight io;
+
+#ifdef HAVE_TIMER_SLACK
+	/* zero resets slack to default, 1ns is minimum */
+	if (timer_slack >= 0 &&
+	    prctl(PR_SET_TIMERSLACK, timer_slack ? timer_slack : 1, 0, 0, 0))
+		err(2, "failed to set timer slack");
+#endif
+
+	time_now = now();
+	time_next = time_now;
+
+	if (arrival == ARRIVAL_ONOFF)
+		arrival_switch = time_now + random_exp(arrival_on);
+
+	if (replay) {
+#ifdef HAVE_PTHREAD
+		if (self)
+			replay_next = (self - workers) % nr_threads;
+#endif
+		if (interval && replay_next < nr_replay)
+			time_next = replay_start + replay[replay_next].time;
+	}
+
+	if (iodepth > 1) {
+		queue_requests();
+		return;
+	}
+
+	io.buf = buf;
+
+	/* replay might start with delay */
+	wait_request();
+
+	while (!exiting && claim_request()) {
+		prepare_request(&io);
+
+		if (nr_meta_ops) {
+			io.start = now();
+			io.result = meta_request(&io);
+			io.error = errno;
+			time_now = now();
+		} else if (use_mmap) {
+			io.start = now();
+			map_request(&io);
+			time_now = now();
+			if (io.sync_time)
+				io.sync_time = time_now - io.sync_time;
+		} else if (sync_ping) {
+			/* dirty range outside of measurement */
+			io.result = make_pwrite(target_fd, io.buf, io.size, io.offset);
+			io.error = errno;
+			io.start = now();
+			if (io.result >= 0)
+				sync_file(target_fd);
+			time_now = now();
+		} else {
+			io.start = now();
+
+			if (io.write)
+				io.result = make_pwrite(target_fd, io.buf, io.size, io.offset);
+			else
+				io.result = make_pread(target_fd, io.buf, io.size, io.offset);
+			io.error = errno;
+
+			if (io.result >= 0 && io.write && !cached) {
+				io.sync_time = now();
+				sync_file(target_fd);
+			}
+
+			time_now = now();
+			if (io.sync_time)
+				io.sync_time = time_now - io.sync_time;
+		}
+
+		/* flush is accounted outside of measured window */
+		if (io.sync_time && io.result >= 0)
+			account_sync(io.sync_time);
+
+		schedule_request();
+
+		complete_request(&io, time_now - io.start);
+
+		if (stop_request())
+			break;
+
+		wait_request();
+	}
+}
+
+#ifdef HAVE_PTHREAD
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+
+	self = w;
+	target = w->target;
+	target_fd = w->fd;
+	buf = w->buf;
+	random_state[0] = w->random_state[0];
+	random_state[1] = w->random_state[1];
+	random_lanes_init();
+
+	if (w->cpu >= 0)
+		bind_cpu(w->cpu);
+
+	start_engine();
+	run_requests();
+
+	pthread_mutex_lock(&workers_lock);
+	nr_running--;
+	pthread_cond_signal(&workers_cond);
+	pthread_mutex_unlock(&workers_lock);
+
+	return NULL;
+}
+
+/* each worker gets own fd, buffer and random sequence */
+static void setup_workers(void)
+{
+	int i, ret;
+
+	workers = calloc(nr_workers, sizeof(*workers));
+	if (!workers)
+		err(2, NULL);
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_mutex_init(&w->lock, NULL);
+		w->target = &targets[i / nr_threads];
+		w->cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+		w->fd = dup(w->target->fd);
+		if (w->fd < 0)
+			err(2, "dup failed");
+		ret = posix_memalign(&w->buf, 0x1000, size * iodepth);
+		if (ret)
+			errx(2, "buffer allocation failed");
+		random_memory(w->buf, size * iodepth);
+		w->random_state[0] = random64_seed();
+		w->random_state[1] = random64_seed();
+	}
+}
+
+static void collect_workers(void)
+{
+	int i;
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_mutex_lock(&w->lock);
+		merge_statset(&w->target->part, &w->stat);
+		start_statset(&w->stat, time_now);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static void run_workers(void)
+{
+	pthread_condattr_t attr;
+	int i, ret;
+
+	pthread_condattr_init(&attr);
+#ifdef HAVE_CLOCK_GETTIME
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&workers_cond, &attr);
+
+	nr_running = nr_workers;
+
+	for (i = 0; i < nr_workers; i++) {
+		start_statset(&workers[i].stat, time_now);
+		ret = pthread_create(&workers[i].thread, NULL,
+				     run_worker, &workers[i]);
+		if (ret) {
+			errno = ret;
+			err(2, "failed to start thread");
+		}
+	}
+
+	pthread_mutex_lock(&workers_lock);
+	while (nr_running) {
+		struct timespec ts;
+		long long deadline;
+
+		if (!period_time) {
+			pthread_cond_wait(&workers_cond, &workers_lock);
+			continue;
+		}
+
+		deadline = system_deadline(period_deadline);
+		ts.tv_sec = deadline / NSEC_PER_SEC;
+		ts.tv_nsec = deadline % NSEC_PER_SEC;
+		if (pthread_cond_timedwait(&workers_cond, &workers_lock,
+					   &ts) != ETIMEDOUT)
+			continue;
+
+		pthread_mutex_unlock(&workers_lock);
+		time_now = now();
+		collect_workers();
+		report_period();
+		pthread_mutex_lock(&workers_lock);
+	}
+	pthread_mutex_unlock(&workers_lock);
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	time_now = now();
+	collect_workers();
+}
+
+#else /* HAVE_PTHREAD */
+
+static void setup_workers(void)
+{
+	errx(1, "threads and multiple targets are not supported by this platform");
+}
+
+static void run_workers(void)
+{
+}
+
+#endif /* HAVE_PTHREAD */
+
+#define PREPARE_CHUNK	(1 << 20)
+#define PREPARE_WRITERS	4
+
+struct prepare {
+	struct target	*target;
+	void		*pool;
+	int		index;
+	int		count;
+	unsigned long long	random_state[2];
+	unsigned long long	salt;	/* same for all chunks of target */
+};
+
+/* each writer fills every n-th chunk with fresh data from own stream */
+static void *prepare_writer(void *arg)
+{
+	struct prepare *p = arg;
+	struct target *t = p->target;
+	off_t pos, length, done, i;
+	ssize_t ret;
+
+	/* first writer runs in main thread and continues its stream */
+	if (p->index) {
+		random_state[0] = p->random_state[0];
+		random_state[1] = p->random_state[1];
+		random_lanes_init();
+	}
+
+	for (pos = (off_t)p->index * PREPARE_CHUNK; pos < t->wsize;
+	     pos += (off_t)p->count * PREPARE_CHUNK) {
+		length = t->wsize - pos;
+		if (length > PREPARE_CHUNK)
+			length = PREPARE_CHUNK;
+
+		if (data_pool) {
+			for (i = 0; i < length; i += POOL_BLOCK)
+				pool_block((char *)p->pool + i,
+					   length - i < POOL_BLOCK ?
+						length - i : POOL_BLOCK,
+					   (offset + pos + i) / POOL_BLOCK, p->salt);
+		} else
+			random_memory(p->pool, length);
+
+		if (verify)
+			verify_stamp(p->pool, offset + pos, length, 0);
+
+		for (done = 0; done < length; done += ret) {
+			ret = pwrite(t->fd, (char *)p->pool + done,
+				     length - done, offset + pos + done);
+			if (ret <= 0)
+				err(2, "preparation write failed");
+		}
+	}
+
+	return NULL;
+}
+
+static void prepare_file(struct target *t)
+{
+	struct prepare writers[PREPARE_WRITERS];
+	unsigned long long salt = random64();
+	long long start = now();
+	int i, nr_writers = 1;
+	struct stat st;
+
+	/* kept data cannot be trusted by -verify */
+	if (keep_file && !verify) {
+		if (fstat(t->fd, &st))
+			err(2, "fstat at \"%s\" failed", t->path);
+		if (st.st_size >= offset + t->wsize)
+#ifndef __MINGW32__
+		    if (st.st_blocks >= (st.st_size + 511) / 512)
+#endif
+			goto skip_preparation;
+	}
+
+#ifdef HAVE_FALLOCATE
+	/* reserve space at once, but not all filesystems support this */
+	if (fallocate(t->fd, 0, offset, t->wsize) &&
+	    errno != EOPNOTSUPP && errno != ENOSYS)
+		err(2, "fallocate failed");
+#endif
+
+#ifdef HAVE_PTHREAD
+	nr_writers = (t->wsize + PREPARE_CHUNK - 1) / PREPARE_CHUNK;
+	if (nr_writers > PREPARE_WRITERS)
+		nr_writers = PREPARE_WRITERS;
+#endif
+
+	for (i = 0; i < nr_writers; i++) {
+		struct prepare *p = &writers[i];
+
+		p->target = t;
+		p->index = i;
+		p->count = nr_writers;
+		if (posix_memalign(&p->pool, 0x1000, PREPARE_CHUNK))
+			errx(2, "buffer allocation failed");
+		p->random_state[0] = random64_seed();
+		p->random_state[1] = random64_seed();
+		p->salt = salt;
+	}
+
+#ifdef HAVE_PTHREAD
+	{
+		pthread_t threads[PREPARE_WRITERS];
+
+		int ret;
+
+		for (i = 1; i < nr_writers; i++) {
+			ret = pthread_create(&threads[i], NULL,
+					     prepare_writer, &writers[i]);
+			if (ret) {
+				errno = ret;
+				err(2, "failed to start preparation thread");
+			}
+		}
+		prepare_writer(&writers[0]);
+		for (i = 1; i < nr_writers; i++)
+			pthread_join(threads[i], NULL);
+	}
+#else
+	prepare_writer(&writers[0]);
+#endif
+
+	for (i = 0; i < nr_writers; i++)
+		free(writers[i].pool);
+
+	t->prep_size = t->wsize;
+	t->prep_writers = nr_writers;
+
+	if (verify)
+		memset(t->verify_map, verify_tag(0),
+		       (t->wsize + VERIFY_BLOCK - 1) / VERIFY_BLOCK);
+
+skip_preparation:
+	if (fsync(t->fd))
+		err(2, "fsync failed");
+
+	if (t->prep_size)
+		t->prep_time = now() - start;
+}
+
+static void open_target(struct target *t)
+{
+	struct stat st;
+
+	if (stat(t->path, &st))
+		err(2, "stat \"%s\" failed", t->path);
+
+	if (nr_meta_ops) {
+		if (!S_ISDIR(st.st_mode))
+			errx(2, "metadata mode requires directory: \"%s\"",
+			     t->path);
+		t->fd = meta_setup(t);
+		parse_device(t, st.st_dev);
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode) && write_test && write_test < 3)
+		errx(2, "think twice, then use -WWW to shred this target");
+
+	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+		if (S_ISDIR(st.st_mode))
+			st.st_size = offset + temp_wsize;
+	} else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
+		t->fd = open_file(t->path, NULL);
+		if (t->fd < 0)
+			err(2, "failed to open \"%s\"", t->path);
+
+		if (get_device_size(t->fd, &st)) {
+			if (!S_ISCHR(st.st_mode))
+				err(2, "block get size ioctl failed");
+			st.st_size = offset + temp_wsize;
+			t->fstype = "character";
+			t->device = "device";
+		} else {
+			t->device_size = st.st_size;
+			t->fstype = "block";
+			t->device = "device";
+		}
+	} else {
+		errx(2, "unsupported destination: \"%s\"", t->path);
+	}
+
+	if (wsize > st.st_size || offset > st.st_size - wsize)
+		errx(2, "target is too small for this");
+
+	t->wsize = wsize ? wsize : st.st_size - offset;
+
+	if (size > t->wsize)
+		errx(2, "request size is too big for this target");
+
+	if (verify)
+		verify_setup(t, S_ISDIR(st.st_mode));
+
+	if (S_ISDIR(st.st_mode)) {
+		t->fd = open_file(t->path, "ioping.tmp");
+		if (t->fd < 0)
+			err(2, "failed to create temporary file at \"%s\"", t->path);
+		prepare_file(t);
+	} else if (S_ISREG(st.st_mode)) {
+		t->fd = open_file(t->path, NULL);
+		if (t->fd < 0)
+			err(2, "failed to open \"%s\"", t->path);
+	}
+
+	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
+		parse_device(t, st.st_dev);
+
+	/* No readahead for non-cached I/O, we'll invalidate it anyway */
+	if (randomize || !cached) {
+#ifdef HAVE_POSIX_FADVICE
+		if (posix_fadvise(t->fd, offset, t->wsize, POSIX_FADV_RANDOM))
+			warn("fadvise(RANDOM) failed, "
+			     "operations might perform unneeded readahead");
+#endif
+	}
+
+	if (!cached) {
+#ifdef HAVE_NOCACHE_IO
+		if (fcntl(t->fd, F_NOCACHE, 1))
+			err(2, "fcntl(F_NOCACHE) failed, "
+			       "please retry with option -C");
+#endif
+	}
+}
+
+#ifdef HAVE_MMAP
+
+/* map working set, requests fault pages in */
+static void map_target(struct target *t)
+{
+	size_t length = offset + t->wsize;
+	void *map;
+
+	map = mmap(NULL, length, write_test ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, t->fd, 0);
+	if (map == MAP_FAILED)
+		err(2, "mmap \"%s\" failed", t->path);
+
+	/* fault only requested page */
+	if (madvise(map, length, MADV_RANDOM))
+		warn("madvise(RANDOM) failed, "
+		     "page faults might perform unneeded readahead");
+
+	t->map = map;
+}
+
+#else /* HAVE_MMAP */
+
+static void map_target(struct target *t)
+{
+	(void)t;
+	errx(1, "mmap is not supported by this platform");
+}
+
+#endif /* HAVE_MMAP */
+
+static void print_latency(const char *prefix, struct statistics *s)
+{
+	unsigned i;
+
+	printf("%smin/avg/max/mdev = ", prefix);
+	print_time(s->min);
+	printf(" / ");
+	print_time(s->avg);
+	printf(" / ");
+	print_time(s->max);
+	printf(" / ");
+	print_time(s->mdev);
+	printf("\n");
+
+	printf("%sp50/p90/p99/p99.9/p99.99 = ", prefix);
+	for (i = 0; i < NR_PERCENTILES; i++) {
+		if (i)
+			printf(" / ");
+		print_time(s->percentile[i]);
+	}
+	printf("\n");
+}
+
+static void print_operation(const char *name, struct statistics *s)
+{
+	char prefix[16];
+
+	printf("%s ", name);
+	print_int(s->valid);
+	printf(" requests, ");
+	/* cache flushes transfer nothing */
+	if (s->size) {
+		print_size(s->size);
+		printf(", ");
+	}
+	print_int(s->iops);
+	printf(" iops");
+	if (s->size) {
+		printf(", ");
+		print_size(s->speed);
+		printf("/s");
+	}
+	printf("\n");
+
+	snprintf(prefix, sizeof(prefix), "%s ", name);
+	print_latency(prefix, s);
+}
+
+static void print_statistics(struct target *t, struct statset *ss)
+{
+	struct statistics *s = &ss->all, *co = &ss->co;
+	int i;
+
+	printf("\n--- %s (%s %s ", t->path, t->fstype, t->device);
+	print_size(t->device_size);
+	printf(") ioping statistics ---\n");
+	print_int(s->valid);
+	printf(" requests completed in ");
+	print_time(s->sum);
+	printf(", ");
+	if (!nr_meta_ops) {
+		print_size(s->size);
+		printf("%s, ", mixed_rw() ? "" :
+				write_test ? " written" : " read");
+	}
+	print_int(s->iops);
+	printf(" iops");
+	if (!nr_meta_ops) {
+		printf(", ");
+		print_size(s->speed);
+		printf("/s");
+	}
+	printf("\n");
+
+	if (s->too_fast) {
+		print_int(s->too_fast);
+		printf(" too fast, ");
+	}
+	if (s->too_slow) {
+		print_int(s->too_slow);
+		printf(" too slow, ");
+	}
+	if (s->corrupted) {
+		print_int(s->corrupted);
+		printf(" corrupted, ");
+	}
+	printf("generated ");
+	print_int(s->count);
+	printf(" requests in ");
+	print_time(s->load_time);
+	printf(", ");
+	print_size(s->load_size);
+	printf(", ");
+	print_int(s->load_iops);
+	printf(" iops, ");
+	print_size(s->load_speed);
+	printf("/s\n");
+
+	if (async || async_uring || nr_threads > 1) {
+		printf("%s engine", engine);
+		if (engine_mode[0])
+			printf(" (%s)", engine_mode);
+		printf(", iodepth %d", iodepth);
+		if (nr_threads > 1)
+			printf(", threads %d", nr_threads);
+		printf("\n");
+	}
+
+	print_latency("", s);
+
+	printf("%s clock, read overhead ", clock_source);
+	print_time(clock_overhead);
+	printf(", resolution ");
+	print_time(clock_resolution);
+	printf("\n");
+
+	if (t->prep_size && t->prep_time) {
+		printf("prepared ");
+		print_size(t->prep_size);
+		printf(" in ");
+		print_time(t->prep_time);
+		printf(", ");
+		print_size((double)t->prep_size * NSEC_PER_SEC / t->prep_time);
+		printf("/s, %d writers\n", t->prep_writers);
+	}
+
+	if (interval && s->sched_count) {
+		printf("schedule error min/avg/max = ");
+		print_time(s->sched_min);
+		printf(" / ");
+		print_time(s->sched_avg);
+		printf(" / ");
+		print_time(s->sched_max);
+		printf("\n");
+	}
+
+	if (co_correct) {
+		printf("corrected for coordinated omission: ");
+		print_int(co->valid);
+		printf(" requests, ");
+		print_int(co->valid - s->valid);
+		printf(" backfilled\n");
+		print_latency("corrected ", co);
+	}
+
+	if (mixed_rw()) {
+		print_operation("read", &ss->op[0]);
+		print_operation("write", &ss->op[1]);
+	}
+
+	for (i = 0; i < nr_size_split; i++)
+		print_operation(size_split[i].name, &ss->split[i]);
+
+	if (split_sync()) {
+		print_operation("data", &ss->data);
+		print_operation("sync", &ss->sync);
+	}
+
+	for (i = 0; i < NR_META_OPS; i++)
+		if (meta_used[i])
+			print_operation(meta_names[i], &ss->meta[i]);
+}
+
+#ifdef HAVE_MMAP
+
+static void decode_record(struct trace_header *hdr, struct trace_record *rec)
+{
+	printf("%u,%llu,%s,%llu,%u,%lld,%lld,%lld,%lld,%s\n",
+	       rec->target,
+	       (unsigned long long)rec->request,
+	       rec->write ? "write" : "read",
+	       (unsigned long long)rec->offset,
+	       rec->size,
+	       (long long)(rec->start - hdr->start),
+	       (long long)(rec->finish - hdr->start),
+	       (long long)(rec->finish - rec->start),
+	       (long long)rec->result,
+	       rec->engine < NR_TRACE_ENGINES ?
+			trace_engines[rec->engine] : "unknown");
+}
+
+/* turn trace back into per-target statistics or csv */
+static void decode_trace(const char *path)
 {
-	ssize_t ret_size;
+	static char engine_name[16], clock_name[16];
+	struct target *decoded = NULL;
+	struct trace_header *hdr;
+	struct trace_record *rec;
+	long long nr, i, last;
+	int nr_decoded = 0, j;
 	struct stat st;
-	int valid;
-	int ret;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		err(2, "failed to open trace \"%s\"", path);
+	if (fstat(fd, &st))
+		err(2, "stat \"%s\" failed", path);
+	if (st.st_size < (off_t)sizeof(*hdr))
+		errx(2, "\"%s\" is not ioping trace", path);
+
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		err(2, "failed to map trace \"%s\"", path);
+
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(*rec))
+		errx(2, "\"%s\" is not ioping trace or has unsupported version",
+		     path);
+
+	rec = (struct trace_record *)(hdr + 1);
+	nr = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+	last = hdr->start;
+
+	if (!strcmp(trace_decode, "csv")) {
+		for (i = 0; i < nr; i++)
+			if (rec[i].request)
+				decode_record(hdr, rec + i);
+		goto out;
+	}
+
+	/* calculate statistics as recording run did */
+	size = hdr->size;
+	iodepth = hdr->iodepth;
+	nr_threads = hdr->threads;
+	clock_overhead = hdr->clock_overhead;
+	clock_resolution = hdr->clock_resolution;
+	memcpy(engine_name, hdr->engine, sizeof(engine_name) - 1);
+	memcpy(clock_name, hdr->clock, sizeof(clock_name) - 1);
+	engine = engine_name;
+	clock_source = clock_name;
+	async = !strcmp(engine, "aio");
+	async_uring = !strcmp(engine, "uring");
+
+	for (i = 0; i < nr; i++) {
+		struct target *t;
+
+		/* not written due to crash */
+		if (!rec[i].request)
+			continue;
+
+		while (rec[i].target >= nr_decoded) {
+			decoded = realloc(decoded, sizeof(*decoded) *
+					  (nr_decoded + 1));
+			if (!decoded)
+				err(2, NULL);
+			t = &decoded[nr_decoded++];
+			memset(t, 0, sizeof(*t));
+			t->path = (char *)path;
+			t->fstype = "trace";
+			if (asprintf(&t->device, "#%d", nr_decoded - 1) < 0)
+				err(2, NULL);
+			start_statset(&t->total, hdr->start);
+		}
+
+		t = &decoded[rec[i].target];
+		add_statistics(&t->total.op[rec[i].write], rec[i].request,
+			       rec[i].size, rec[i].result < 0 ? 0 : rec[i].result,
+			       rec[i].finish - rec[i].start);
+		add_statistics(&t->total.all, rec[i].request, rec[i].size,
+			       rec[i].result < 0 ? 0 : rec[i].result,
+			       rec[i].finish - rec[i].start);
+		if ((long long)rec[i].finish > last)
+			last = rec[i].finish;
+	}
+
+	/* report reads and writes separately if both were traced */
+	for (j = 0; j < nr_decoded; j++)
+		if (decoded[j].total.op[0].count &&
+		    decoded[j].total.op[1].count)
+			write_read_test = 1;
+
+	for (j = 0; j < nr_decoded; j++) {
+		struct target *t = &decoded[j];
+
+		finish_statset(&t->total, last);
+
+		if (json)
+			json_statistics(t, &t->total);
+		else if (batch_mode)
+			dump_statistics(&t->total);
+		else
+			print_statistics(t, &t->total);
+	}
+
+	for (j = 0; j < nr_decoded; j++)
+		free(decoded[j].device);
+	free(decoded);
+out:
+	munmap(hdr, st.st_size);
+	close(fd);
+}
+
+#else /* HAVE_MMAP */
+
+static void decode_trace(const char *path)
+{
+	(void)path;
+	errx(1, "trace is not supported by this platform");
+}
 
-	struct statistics part, total;
+#endif /* HAVE_MMAP */
 
-	long long this_time;
-	long long time_now, time_next, period_deadline;
+int main (int argc, char **argv)
+{
+	int ret, i;
 
 	parse_options(argc, argv);
 
 	setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
 
+	if (trace_decode) {
+		if (json)
+			printf("[");
+		else if (!strcmp(trace_decode, "csv"))
+			printf("target,request,operation,offset,size,"
+			       "start,finish,time,result,engine\n");
+		for (i = 0; i < nr_targets; i++)
+			decode_trace(targets[i].path);
+		if (json)
+			printf("]\n");
+		return 0;
+	}
+
+	if (replay_path)
+		replay_load();
+
+	if (nr_size_split) {
+		if (replay_path)
+			errx(1, "size split is not compatible with replay");
+		size = min_size = size_split[0].size;
+		for (i = 1; i < nr_size_split; i++) {
+			if (size_split[i].size > size)
+				size = size_split[i].size;
+			if (size_split[i].size < min_size)
+				min_size = size_split[i].size;
+		}
+	}
+
 	if (!size)
 		size = default_size;
 
+	if (!min_size)
+		min_size = size;
+
 	if (size <= 0)
 		errx(1, "request size must be greater than zero");
 
@@ -1786,6 +6029,57 @@ int main (int argc, char **argv)
 			interval = i;
 	}
 
+	/* metrics are updated at each period */
+	if ((metrics_addr || metrics_file) && !period_time && !period_request) {
+		period_time = NSEC_PER_SEC;
+		metrics_only = 1;
+	}
+
+	/* expected time between requests */
+	co_interval = burst ? interval / burst : interval;
+
+#ifndef HAVE_TIMER_SLACK
+	if (timer_slack >= 0)
+		errx(1, "timer slack is not supported by this platform");
+#endif
+
+	if (distribution != DIST_UNIFORM && !randomize)
+		errx(1, "offset distribution requires random operations");
+
+	if (arrival != ARRIVAL_FIXED && interval <= 0)
+		errx(1, "arrival model requires interval, speed-limit or rate-limit");
+
+	arrival_jitter = interval * arrival_jitter_pct / 100;
+
+	if (nr_meta_ops && (write_test || replay_path || trace_path ||
+			    nr_size_split || iodepth > 1))
+		errx(1, "metadata mode is not compatible with write, replay, "
+			"trace, size split or iodepth");
+
+	if (verify && (use_mmap || nr_meta_ops || replay_path || dedupe_ratio))
+		errx(1, "verify is not compatible with mmap, metadata, "
+			"replay or dedupe");
+
+	if (verify && (size % VERIFY_BLOCK || offset % VERIFY_BLOCK))
+		errx(1, "verify requires request size and offset "
+			"aligned to %d", VERIFY_BLOCK);
+
+	for (i = 0; verify && i < nr_size_split; i++)
+		if (size_split[i].size % VERIFY_BLOCK)
+			errx(1, "verify requires request size and offset "
+				"aligned to %d", VERIFY_BLOCK);
+
+	/* read must not race with write of the same block */
+	if (verify && write_test && (iodepth > 1 || nr_threads > 1))
+		errx(1, "verify with writes requires iodepth and threads 1");
+
+	if (sync_ping && (write_read_test || rw_mix >= 0 || replay_path))
+		errx(1, "sync ping is not compatible with mixed I/O or replay");
+
+	if (co_correct && co_interval <= 0)
+		errx(1, "coordinated omission correction requires schedule, "
+			"set interval, speed-limit or rate-limit");
+
 #ifdef MAX_RW_COUNT
 	if (size > MAX_RW_COUNT)
 		warnx("this platform supports requests %u bytes at most",
@@ -1811,14 +6105,25 @@ int main (int argc, char **argv)
 # endif
 	}
 #endif
+	if (use_mmap && (async || async_uring || rw_flags || direct ||
+			 sync_ping || nr_meta_ops))
+		errx(1, "mmap is not compatible with asynchronous, direct, "
+			"nowait, hipri, sync ping or metadata");
+
 	if (async_uring) {
 		uring_setup();
+	} else if (use_mmap) {
+#ifdef HAVE_MMAP
+		page_size = sysconf(_SC_PAGESIZE);
+#endif
+		engine = "mmap";
 	} else if (async) {
 		aio_setup();
 	} else if (rw_flags) {
 #ifdef HAVE_LINUX_PREADV2
 		make_pread = do_preadv2;
 		make_pwrite = do_pwritev2;
+		engine = "preadv2";
 #else
 		warnx("nowait/hipri I/O is not supported");
 #endif
@@ -1827,7 +6132,21 @@ int main (int argc, char **argv)
 	if ((rw_flags & RWF_NOWAIT) && !cached && !direct)
 		warnx("nowait without cached or direct I/O is supposed to fail");
 
-	make_request = write_test ? make_pwrite : make_pread;
+	if (iodepth < 1)
+		errx(1, "iodepth must be greater than zero");
+
+	if (iodepth > 1 && !queue_run)
+		errx(1, "iodepth requires asynchronous I/O (-A or -U)");
+
+	if (iodepth > 1 && sync_ping)
+		errx(1, "sync ping requires iodepth 1");
+
+	if (nr_threads < 1)
+		errx(1, "count of threads must be greater than zero");
+
+	if ((nr_threads > 1 || nr_targets > 1) && period_request)
+		errx(1, "print-count is not supported for threads and multiple targets, "
+			"use print-interval");
 
 #ifndef HAVE_DIRECT_IO
 	if (direct)
@@ -1844,105 +6163,41 @@ int main (int argc, char **argv)
 		errx(1, "data sync I/O not supported by this platform");
 #endif
 
-	if (stat(path, &st))
-		err(2, "stat \"%s\" failed", path);
-
-	if (!S_ISDIR(st.st_mode) && write_test && write_test < 3)
-		errx(2, "think twice, then use -WWW to shred this target");
-
-	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
-		if (S_ISDIR(st.st_mode))
-			st.st_size = offset + temp_wsize;
-	} else if (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode)) {
-		target_fd = open_file(path, NULL);
-		if (target_fd < 0)
-			err(2, "failed to open \"%s\"", path);
-
-		if (get_device_size(target_fd, &st)) {
-			if (!S_ISCHR(st.st_mode))
-				err(2, "block get size ioctl failed");
-			st.st_size = offset + temp_wsize;
-			fstype = "character";
-			device = "device";
-		} else {
-			device_size = st.st_size;
-			fstype = "block";
-			device = "device";
-		}
-	} else {
-		errx(2, "unsupported destination: \"%s\"", path);
-	}
-
-	if (wsize > st.st_size || offset > st.st_size - wsize)
-		errx(2, "target is too small for this");
-
-	if (!wsize)
-		wsize = st.st_size - offset;
-
-	if (size > wsize)
-		errx(2, "request size is too big for this target");
+	clock_init();
 
-	ret = posix_memalign(&buf, 0x1000, size);
+	ret = posix_memalign(&buf, 0x1000, size * iodepth);
 	if (ret)
 		errx(2, "buffer allocation failed");
 
 	random_init();
 
-	random_memory(buf, size);
+	if (compress_ratio || dedupe_ratio)
+		pool_init();
 
-	if (S_ISDIR(st.st_mode)) {
-		target_fd = open_file(path, "ioping.tmp");
-		if (target_fd < 0)
-			err(2, "failed to create temporary file at \"%s\"", path);
-		if (keep_file) {
-			if (fstat(target_fd, &st))
-				err(2, "fstat at \"%s\" failed", path);
-			if (st.st_size >= offset + wsize)
-#ifndef __MINGW32__
-			    if (st.st_blocks >= (st.st_size + 511) / 512)
-#endif
-				goto skip_preparation;
-		}
-		for (woffset = 0 ; woffset < wsize ; woffset += ret_size) {
-			ret_size = size;
-			if (woffset + ret_size > wsize)
-				ret_size = wsize - woffset;
-			if (woffset)
-				random_memory(buf, ret_size);
-			ret_size = pwrite(target_fd, buf, ret_size, offset + woffset);
-			if (ret_size <= 0)
-				err(2, "preparation write failed");
-		}
-skip_preparation:
-		if (fsync(target_fd))
-			err(2, "fsync failed");
-	} else if (S_ISREG(st.st_mode)) {
-		target_fd = open_file(path, NULL);
-		if (target_fd < 0)
-			err(2, "failed to open \"%s\"", path);
+	if (verify) {
+		crc32c_init();
+		verify_init();
 	}
 
-	if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))
-		parse_device(st.st_dev);
+	random_memory(buf, size);
 
-	/* No readahead for non-cached I/O, we'll invalidate it anyway */
-	if (randomize || !cached) {
-#ifdef HAVE_POSIX_FADVICE
-		ret = posix_fadvise(target_fd, offset, wsize, POSIX_FADV_RANDOM);
-		if (ret)
-			warn("fadvise(RANDOM) failed, "
-			     "operations might perform unneeded readahead");
-#endif
+	for (i = 0; i < nr_targets; i++) {
+		open_target(&targets[i]);
+		if (targets[i].wsize)
+			init_distribution(&targets[i]);
+		if (use_mmap)
+			map_target(&targets[i]);
+		if (replay)
+			replay_check(&targets[i]);
 	}
 
-	if (!cached) {
-#ifdef HAVE_NOCACHE_IO
-		ret = fcntl(target_fd, F_NOCACHE, 1);
-		if (ret)
-			err(2, "fcntl(F_NOCACHE) failed, "
-			       "please retry with option -C");
-#endif
-	}
+	nr_workers = nr_targets * nr_threads;
+
+	target = &targets[0];
+	target_fd = target->fd;
+
+	if (nr_workers > 1)
+		setup_workers();
 
 	set_signal();
 
@@ -1950,8 +6205,12 @@ skip_preparation:
 
 	time_now = now();
 
-	start_statistics(&part, time_now);
-	start_statistics(&total, time_now);
+	replay_start = time_now;
+
+	for (i = 0; i < nr_targets; i++) {
+		start_statset(&targets[i].part, time_now);
+		start_statset(&targets[i].total, time_now);
+	}
 
 	if (json)
 		printf("[");
@@ -1961,194 +6220,51 @@ skip_preparation:
 
 	period_deadline = time_now + period_time;
 
-	time_next = time_now;
-
-	while (!exiting) {
-		request++;
-
-		if (randomize)
-			woffset = random64() % (wsize / size) * size;
-
-#ifdef HAVE_POSIX_FADVICE
-		if (!cached) {
-			ret = posix_fadvise(target_fd, offset + woffset, size,
-					    POSIX_FADV_DONTNEED);
-			if (ret)
-				err(3, "fadvise(DONTNEED) failed, "
-				       "please retry with option -C");
-		}
-#endif
-
-		if (write_read_test) {
-			write_test = request & 1;
-			make_request = write_test ? make_pwrite : make_pread;
-		}
-
-		if (write_test)
-			random_memory(buf, size);
-
-		this_time = now();
-
-		ret_size = make_request(target_fd, buf, size, offset + woffset);
-
-		if (ret_size < 0) {
-			if (ignore_error || errno == EINTR || ((rw_flags & RWF_NOWAIT) && errno == EAGAIN)) {
-				ret_size = 0;
-				notice = errno_name();
-			} else
-				err(3, "request failed: %s", errno_name());
-		} else {
-			if (ret_size < size)
-				warnx("request returned less than expected: %zu", ret_size);
-			else if (ret_size > size)
-				errx(3, "request returned more than expected: %zu", ret_size);
-
-			if (write_test && !cached)
-				sync_file(target_fd);
-		}
-
-		time_now = now();
-
-		if (!burst || ++burst_request == burst) {
-		    burst_request = 0;
-		    time_next += interval;
-		}
-
-		if ((time_now - time_next) > 0)
-			time_next = time_now;
-
-		this_time = time_now - this_time;
-
-		timestamp_uptodate = 0;
-
-		valid = add_statistics(&part, ret_size, this_time);
-
-		if (quiet) {
-			/* silence */
-		} else if (json) {
-			json_request(ret_size, this_time, valid);
-		} else {
-			if (time_info) {
-				update_timestamp();
-				printf("%s ", localtime_str);
-			}
-			print_size(ret_size);
-			printf(" %s %s (%s %s ", write_test ? ">>>" : "<<<",
-					path, fstype, device);
-			print_size(device_size);
-			printf("): request=%llu time=", request);
-			print_time(this_time);
-			if (notice)
-			    printf(" (%s)", notice);
-			if (burst && !burst_request)
-			    printf("\n");
-			printf("\n");
-		}
-
-		if ((period_request && (part.valid >= period_request)) ||
-		    (period_time && (time_next >= period_deadline))) {
-			finish_statistics(&part, time_now);
-			if (json)
-				json_statistics(&part);
-			else
-				dump_statistics(&part);
-			fflush(stdout);
-			merge_statistics(&total, &part);
-			start_statistics(&part, time_now);
-			period_deadline = time_now + period_time;
-		}
-
-		if (!randomize) {
-			woffset += size;
-			if (woffset + size > wsize)
-				woffset = 0;
-		}
-
-		if (exiting)
-			break;
-
-		if (stop_at_request && request >= stop_at_request)
-			break;
-
-		if (deadline && time_next >= deadline)
-			break;
-
-		if ((time_next - time_now) > 0) {
-			long long delta = time_next - time_now;
+	if (metrics_addr)
+		metrics_listen(metrics_addr);
 
-			interval_ts.tv_sec = delta / NSEC_PER_SEC;
-			interval_ts.tv_nsec = delta % NSEC_PER_SEC;
+	if (metrics_addr || metrics_file)
+		metrics_update();
 
-			if (!quiet)
-			    fflush(stdout);
+	if (trace_path)
+		trace_open(time_now);
 
-			nanosleep(&interval_ts, NULL);
-		}
+	if (nr_workers > 1) {
+		run_workers();
+	} else {
+		if (nr_cpus)
+			bind_cpu(cpus[0]);
+		start_engine();
+		run_requests();
 	}
 
 	time_now = now();
-	finish_statistics(&part, time_now);
-	merge_statistics(&total, &part);
-	finish_statistics(&total, time_now);
 
-	if (json) {
-		json_statistics(&total);
-		printf("]\n");
-		return 0;
-	}
+	for (i = 0; i < nr_targets; i++) {
+		struct target *t = &targets[i];
 
-	if (batch_mode) {
-		dump_statistics(&total);
-		return 0;
+		merge_statset(&t->total, &t->part);
+		finish_statset(&t->total, time_now);
+
+		if (json)
+			json_statistics(t, &t->total);
+		else if (batch_mode)
+			dump_statistics(&t->total);
+		else if (!quiet || metrics_only || !(period_time || period_request))
+			print_statistics(t, &t->total);
 	}
 
-	if (quiet && (period_time || period_request))
-		return 0;
+	if (metrics_file)
+		metrics_update();
 
-	printf("\n--- %s (%s %s ", path, fstype, device);
-	print_size(device_size);
-	printf(") ioping statistics ---\n");
-	print_int(total.valid);
-	printf(" requests completed in ");
-	print_time(total.sum);
-	printf(", ");
-	print_size(total.size);
-	printf("%s, ", write_read_test ? "" :
-			write_test ? " written" : " read");
-	print_int(total.iops);
-	printf(" iops, ");
-	print_size(total.speed);
-	printf("/s\n");
+	if (json)
+		printf("]\n");
 
-	if (total.too_fast) {
-		print_int(total.too_fast);
-		printf(" too fast, ");
-	}
-	if (total.too_slow) {
-		print_int(total.too_slow);
-		printf(" too slow, ");
-	}
-	printf("generated ");
-	print_int(total.count);
-	printf(" requests in ");
-	print_time(total.load_time);
-	printf(", ");
-	print_size(total.load_size);
-	printf(", ");
-	print_int(total.load_iops);
-	printf(" iops, ");
-	print_size(total.load_speed);
-	printf("/s\n");
+	if (trace_path)
+		trace_close();
 
-	printf("min/avg/max/mdev = ");
-	print_time(total.min);
-	printf(" / ");
-	print_time(total.avg);
-	printf(" / ");
-	print_time(total.max);
-	printf(" / ");
-	print_time(total.mdev);
-	printf("\n");
+	if (nr_meta_ops)
+		meta_exit();
 
 	return 0;
 }